@@ -1,7 +1,25 @@
 #include <stdio.h>
 #include "ubt_rpc.h"
+#include "ubt_rpc_trace.h"
 
-#define RPC_LOG_D(...)  (rpc_printf("[RPC] ");rpc_printf(__VA_ARGS__);rpc_printf("\r\n");)
+/* slow path only, hot paths record RPC_TRACE events */
+#define RPC_LOG_D(...)  do { rpc_printf("[RPC] "); rpc_printf(__VA_ARGS__); rpc_printf("\r\n"); } while (0)
+
+#ifdef RPC_STATIC_MEMORY
+#define RPC_ALIGN(x)                (((x) + 7UL) & ~7UL)
+#define RPC_ALLOC(rpc, pool, size)  ubt_rpc_pool_alloc((rpc), &(rpc)->pool, (size))
+#define RPC_FREE(rpc, pool, ptr)    ubt_rpc_pool_free((rpc), &(rpc)->pool, (ptr))
+#if defined(RPC_STREAM_SUPPORT) && (RPC_STREAM_WINDOW + 2 > RPC_STATIC_QUEUE_DEPTH)
+#error "RPC_STATIC_QUEUE_DEPTH must hold a stream window"
+#endif
+#else
+#define RPC_ALLOC(rpc, pool, size)  rpc_malloc(size)
+#define RPC_FREE(rpc, pool, ptr)    rpc_free(ptr)
+#endif
+
+#if defined(RPC_DEDUP_SUPPORT) && !defined(rpc_session_seed)
+#error "rpc_session_seed() must be supplied by the port, see ubt_rpc_config.h"
+#endif
 
 static void ubt_rpc_impl_lock(ubt_rpc_t *rpc)
 {
@@ -29,17 +47,65 @@ static uint32_t gen_request_id(ubt_rpc_t *rpc)
 {
     uint32_t id;
     ubt_rpc_impl_lock(rpc);
+#ifdef RPC_DEDUP_SUPPORT
+    id = ((uint32_t)rpc->session << 24) | (rpc->call_id++ & RPC_SEQ_MASK);
+#else
     id = rpc->call_id++;
+#endif
     ubt_rpc_impl_unlock(rpc);
     return id;
 }
 
-static osMessageQueueId_t *get_queue_for_request(ubt_rpc_t *rpc)
+#ifdef RPC_STATIC_MEMORY
+static void ubt_rpc_pool_init(rpc_pool_t *pool, uint8_t *mem, uint32_t block_size, uint32_t count)
+{
+    uint32_t i;
+    slist_init(&pool->free);
+    pool->block_size = block_size;
+    for (i = 0; i < count; i++) {
+        slist_insert(&pool->free, (struct slist_head *)(mem + i * block_size));
+    }
+}
+
+static void *ubt_rpc_pool_alloc(ubt_rpc_t *rpc, rpc_pool_t *pool, uint32_t size)
+{
+    struct slist_head *node = NULL;
+    if (size > pool->block_size) {
+        return NULL;
+    }
+    ubt_rpc_impl_lock(rpc);
+    node = slist_first(&pool->free);
+    if (node) {
+        slist_remove(&pool->free, node);
+    }
+    ubt_rpc_impl_unlock(rpc);
+    return node;
+}
+
+static void ubt_rpc_pool_free(ubt_rpc_t *rpc, rpc_pool_t *pool, void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    ubt_rpc_impl_lock(rpc);
+    slist_insert(&pool->free, (struct slist_head *)ptr);
+    ubt_rpc_impl_unlock(rpc);
+}
+#endif
+
+static osMessageQueueId_t *get_queue_for_request(ubt_rpc_t *rpc, uint16_t depth)
 {
     osMessageQueueId_t *idle_queue = NULL;
     ubt_rpc_impl_lock(rpc);
     if (rpc->active_request < rpc->max_request) {
-        idle_queue = osMessageQueueNew(1, sizeof(rpc_message_t *), NULL);
+#ifdef RPC_STATIC_MEMORY
+        /* queues are created once in ubt_rpc_create, all RPC_STATIC_QUEUE_DEPTH deep */
+        if (depth <= RPC_STATIC_QUEUE_DEPTH && rpc->queue_idle) {
+            idle_queue = rpc->queue_pool[--rpc->queue_idle];
+        }
+#else
+        idle_queue = osMessageQueueNew(depth, sizeof(rpc_message_t *), NULL);
+#endif
         if (idle_queue) {
             rpc->active_request++;
         } else {
@@ -52,77 +118,371 @@ static osMessageQueueId_t *get_queue_for_request(ubt_rpc_t *rpc)
     return idle_queue;
 }
 
-static ubt_rpc_request_t *ubt_rpc_create_request(ubt_rpc_t *rpc, bool need_ack)
+/* the queue must be empty */
+static void ubt_rpc_queue_release(ubt_rpc_t *rpc, osMessageQueueId_t *queue)
+{
+#ifdef RPC_STATIC_MEMORY
+    ubt_rpc_impl_lock(rpc);
+    rpc->queue_pool[rpc->queue_idle++] = queue;
+    ubt_rpc_impl_unlock(rpc);
+#else
+    osMessageQueueDelete(queue);
+#endif
+}
+
+/* queue_depth == 0: fire-and-forget, no slot in the pending table */
+static ubt_rpc_request_t *ubt_rpc_create_request(ubt_rpc_t *rpc, uint16_t queue_depth)
 {
     ubt_rpc_request_t *request = NULL;
     do {
-        request = (ubt_rpc_request_t *)rpc_malloc(sizeof(ubt_rpc_request_t));
-		RPC_LOG_D("%s %d alloc %p", __FUNCTION__, __LINE__, request);
+        request = (ubt_rpc_request_t *)RPC_ALLOC(rpc, req_pool, sizeof(ubt_rpc_request_t));
         if (request == NULL) {
             break;
         }
         memset(request, 0, sizeof(ubt_rpc_request_t));
-        request->data_buf = rpc_malloc(rpc->buffer_size);
-		RPC_LOG_D("%s %d alloc %p", __FUNCTION__, __LINE__, request->data_buf);
+        request->data_buf = RPC_ALLOC(rpc, buf_pool, rpc->buffer_size);
         request->data_len = rpc->buffer_size;
         if (!request->data_buf) {
-            rpc_free(request);
+            RPC_FREE(rpc, req_pool, request);
             request = NULL;
             break;
         }
 
-        if(need_ack){
-            request->queue = get_queue_for_request(rpc);
+        if(queue_depth){
+            request->queue = get_queue_for_request(rpc, queue_depth);
             if (!request->queue) {
-                rpc_free(request->data_buf);
-                rpc_free(request);
+                RPC_FREE(rpc, buf_pool, request->data_buf);
+                RPC_FREE(rpc, req_pool, request);
                 request = NULL;
                 break;
             }
         }
         list_init(&request->list);
     } while (0);
-    RPC_LOG_D("ubt_rpc_create_request %p", request);
+    RPC_TRACE(RPC_TRACE_DBG, RPC_EV_REQ_ALLOC, 0, 0, 0, 0, request);
     return request;
 }
 
+/* free a decoded param or response of cmd */
+static void ubt_rpc_param_free(ubt_rpc_t *rpc, uint32_t cmd, void *param)
+{
+    if (param == NULL) {
+        return;
+    }
+#ifdef RPC_BATCH_SUPPORT
+    if (cmd == RPC_CMD_BATCH || cmd == RPC_CMD_BATCH + 1) {
+        rpc_batch_t *batch = (rpc_batch_t *)param;
+        uint16_t i;
+        for (i = 0; i < batch->count && i < RPC_BATCH_MAX_ITEMS; i++) {
+            if (batch->item[i].data) {
+                RPC_FREE(rpc, param_pool, batch->item[i].data);
+            }
+        }
+    }
+#endif
+    RPC_FREE(rpc, param_pool, param);
+}
+
+/* for the codec: the message of a received frame */
+rpc_message_t *ubt_rpc_message_alloc(ubt_rpc_t *rpc)
+{
+    rpc_message_t *message = (rpc_message_t *)RPC_ALLOC(rpc, msg_pool, sizeof(rpc_message_t));
+    if (message) {
+        memset(message, 0, sizeof(rpc_message_t));
+        message->rpc = rpc;
+    }
+    return message;
+}
+
+/* for the codec and handlers: decoded params, responses returned by request_handler */
+void *ubt_rpc_param_alloc(ubt_rpc_t *rpc, uint32_t size)
+{
+    return RPC_ALLOC(rpc, param_pool, size);
+}
+
+void ubt_rpc_param_release(ubt_rpc_t *rpc, void *param)
+{
+    RPC_FREE(rpc, param_pool, param);
+}
+
 static void ubt_rpc_message_free(rpc_message_t *message)
 {
-    RPC_LOG_D("ubt_rpc_message_free");
+    RPC_TRACE_MSG(RPC_TRACE_DBG, RPC_EV_MSG_FREE, &message->base, message);
     if (message->struct_data) {
-        rpc_free(message->struct_data);
+        ubt_rpc_param_free(message->rpc, message->base.cmd, message->struct_data);
         message->struct_data = NULL;
     }
-    rpc_free(message);
+    RPC_FREE(message->rpc, msg_pool, message);
+}
+
+static void ubt_rpc_send_ack(ubt_rpc_t *rpc, rpc_message_t *message, uint8_t ctrl, uint32_t cmd, uint8_t err, void *rsp, bool keep)
+{
+    rpc_request_config_t req_conf = {
+        .base = {
+#ifdef RPC_ADDRESS_SUPPORT
+            .src = message->base.dst,
+            .dst = message->base.src,
+#endif
+            .ctrl = ctrl,
+            .err = err,
+            .seq = message->base.seq,
+            .cmd = cmd,
+        },
+        .retry = 0,
+        .expect_ack = false,
+        .timeout = 0,
+        .keep_param = keep,
+    };
+    ubt_rpc_perform(rpc, &req_conf, rsp);
+}
+
+#ifdef RPC_DEDUP_SUPPORT
+static void ubt_rpc_dedup_flush(ubt_rpc_t *rpc, rpc_dedup_peer_t *peer)
+{
+    uint8_t i;
+    for (i = 0; i < RPC_DEDUP_RSP_CACHE; i++) {
+        if (peer->rsp[i].rsp) {
+            ubt_rpc_param_free(rpc, peer->rsp[i].cmd, peer->rsp[i].rsp);
+        }
+    }
+    memset(peer, 0, sizeof(rpc_dedup_peer_t));
+}
+
+static rpc_dedup_peer_t *ubt_rpc_dedup_peer(ubt_rpc_t *rpc, rpc_message_t *message)
+{
+#ifdef RPC_ADDRESS_SUPPORT
+    rpc_dedup_peer_t *peer = NULL;
+    uint8_t i;
+
+    for (i = 0; i < RPC_DEDUP_MAX_PEER; i++) {
+        if (rpc->dedup[i].valid && rpc->dedup[i].addr == message->base.src) {
+            return &rpc->dedup[i];
+        }
+        if (!rpc->dedup[i].valid && peer == NULL) {
+            peer = &rpc->dedup[i];
+        }
+    }
+    if (peer == NULL) {
+        peer = &rpc->dedup[rpc->dedup_victim];
+        rpc->dedup_victim = (rpc->dedup_victim + 1) % RPC_DEDUP_MAX_PEER;
+        ubt_rpc_dedup_flush(rpc, peer);
+    }
+    peer->addr = message->base.src;
+    return peer;
+#else
+    return &rpc->dedup[0];
+#endif
+}
+
+/*
+ * return true if seq has already been received from this peer. Anything older than
+ * the window counts as received: it can only be a late retransmit or a reordered frame.
+ * A restart of the peer is told by a new session in the seq, or, when the session came
+ * back the same, by RPC_DEDUP_RESYNC frames in a row from behind the window.
+ */
+static bool ubt_rpc_dedup_check(ubt_rpc_t *rpc, rpc_message_t *message, rpc_dedup_peer_t **out)
+{
+    rpc_dedup_peer_t *peer = ubt_rpc_dedup_peer(rpc, message);
+    uint32_t seq = message->base.seq;
+    uint32_t diff;
+
+    *out = peer;
+    if (peer->valid && peer->session == RPC_SEQ_SESSION(seq)) {
+        diff = (seq - peer->last_seq) & RPC_SEQ_MASK;
+        if (diff && diff <= (RPC_SEQ_MASK >> 1)) {
+            peer->window = (diff >= 32) ? 0 : (peer->window << diff);
+            peer->window |= 1;
+            peer->last_seq = seq;
+            peer->behind = 0;
+            return false;
+        }
+        diff = (peer->last_seq - seq) & RPC_SEQ_MASK;
+        if (diff < RPC_DEDUP_WINDOW) {
+            peer->behind = 0;
+            if (peer->window & (1UL << diff)) {
+                return true;
+            }
+            peer->window |= (1UL << diff);
+            return false;
+        }
+        if (++peer->behind < RPC_DEDUP_RESYNC) {
+            return true;
+        }
+        RPC_LOG_D("peer stuck %d behind the window, resync", (int)diff);
+    } else if (peer->valid) {
+        RPC_LOG_D("peer restarted, session %d -> %d", peer->session, RPC_SEQ_SESSION(seq));
+    }
+    if (peer->valid) {
+#ifdef RPC_ADDRESS_SUPPORT
+        uint8_t addr = peer->addr;
+        ubt_rpc_dedup_flush(rpc, peer);
+        peer->addr = addr;
+#else
+        ubt_rpc_dedup_flush(rpc, peer);
+#endif
+    }
+    peer->valid = true;
+    peer->session = RPC_SEQ_SESSION(seq);
+    peer->last_seq = seq;
+    peer->window = 1;
+    return false;
+}
+
+/* the cmd must match too: a peer back with the same session reuses seqs for other requests */
+static rpc_dedup_rsp_t *ubt_rpc_dedup_lookup(rpc_dedup_peer_t *peer, rpc_message_t *message)
+{
+    uint8_t i;
+    for (i = 0; i < RPC_DEDUP_RSP_CACHE; i++) {
+        if (peer->rsp[i].rsp && peer->rsp[i].seq == message->base.seq && peer->rsp[i].cmd == message->base.cmd + 1) {
+            return &peer->rsp[i];
+        }
+    }
+    return NULL;
+}
+
+/* the cache takes ownership of rsp, it is freed on eviction */
+static rpc_dedup_rsp_t *ubt_rpc_dedup_store(ubt_rpc_t *rpc, rpc_dedup_peer_t *peer, uint32_t seq, uint32_t cmd, uint8_t ctrl, uint8_t err, void *rsp)
+{
+    rpc_dedup_rsp_t *slot = &peer->rsp[peer->rsp_idx];
+    peer->rsp_idx = (peer->rsp_idx + 1) % RPC_DEDUP_RSP_CACHE;
+    if (slot->rsp) {
+        ubt_rpc_param_free(rpc, slot->cmd, slot->rsp);
+    }
+    slot->seq = seq;
+    slot->cmd = cmd;
+    slot->ctrl = ctrl;
+    slot->err = err;
+    slot->rsp = rsp;
+    return slot;
+}
+#endif
+
+#ifdef RPC_BATCH_SUPPORT
+/*
+ * Run every sub-request of a batch through request_handler, the batch itself is
+ * turned into the aggregated ACK: item data becomes the response, item err is
+ * whatever the handler left in the sub message err.
+ */
+static rpc_batch_t *ubt_rpc_batch_dispatch(rpc_message_t *message)
+{
+    rpc_batch_t *batch = (rpc_batch_t *)message->struct_data;
+    rpc_message_t sub;
+    uint16_t i;
+
+    if (batch == NULL) {
+        return NULL;
+    }
+    message->struct_data = NULL;
+    if (batch->count > RPC_BATCH_MAX_ITEMS) {
+        batch->count = RPC_BATCH_MAX_ITEMS;
+    }
+    for (i = 0; i < batch->count; i++) {
+        sub.base = message->base;
+        sub.base.cmd = batch->item[i].cmd;
+        sub.base.err = 0;
+        sub.struct_data = batch->item[i].data;
+        sub.rpc = message->rpc;
+        batch->item[i].data = message->rpc->request_handler(&sub);
+        batch->item[i].err = sub.base.err;
+        if (sub.struct_data) {
+            RPC_FREE(message->rpc, param_pool, sub.struct_data);
+        }
+    }
+    return batch;
+}
+#endif
+
+#ifdef RPC_STREAM_SUPPORT
+/* a retransmitted open whose ACK got lost: the stream is already accepted, ACK it again */
+static bool ubt_rpc_stream_reaccept(ubt_rpc_t *rpc, rpc_message_t *message)
+{
+    ubt_rpc_request_t *iter;
+    bool found = false;
+
+    ubt_rpc_impl_lock(rpc);
+    list_for_each_entry(iter, &rpc->wait_response_head, list) {
+        if (iter->stream && iter->stream->acceptor && iter->base.seq == message->base.seq
+#ifdef RPC_ADDRESS_SUPPORT
+            && iter->base.dst == message->base.src
+#endif
+            ) {
+            found = true;
+            break;
+        }
+    }
+    ubt_rpc_impl_unlock(rpc);
+    if (found) {
+        RPC_TRACE_MSG(RPC_TRACE_INFO, RPC_EV_ACK_REPLAY, &message->base, 0);
+        ubt_rpc_send_ack(rpc, message, ATTR_REQ_ACK, message->base.cmd + 1, 0, NULL, false);
+    }
+    return found;
 }
+#endif
 
 #ifdef RPC_TX_STANDALONE_THREAD
 static void ubt_rpc_handle_input_message(rpc_message_t *message)
 {
+    ubt_rpc_t *rpc;
+#ifdef RPC_DEDUP_SUPPORT
+    rpc_dedup_peer_t *peer = NULL;
+    rpc_dedup_rsp_t *cached;
+#endif
+
     if (message == NULL) {
         return;
     }
+    rpc = message->rpc;
+
+#ifdef RPC_STREAM_SUPPORT
+    if (MSG_IS_REQ(&message->base) && ubt_rpc_stream_reaccept(rpc, message)) {
+        ubt_rpc_message_free(message);
+        return;
+    }
+#endif
+
+#ifdef RPC_DEDUP_SUPPORT
+    if ((MSG_IS_REQ(&message->base) || MSG_IS_NOTIFY(&message->base)) && ubt_rpc_dedup_check(rpc, message, &peer)) {
+        if (MSG_NEED_NOTI_ACK(&message->base)) {
+            ubt_rpc_send_ack(rpc, message, ATTR_NOTI_ACK, message->base.cmd, 0, NULL, false);
+        } else if ((cached = ubt_rpc_dedup_lookup(peer, message)) != NULL) {
+            RPC_TRACE_MSG(RPC_TRACE_INFO, RPC_EV_ACK_REPLAY, &message->base, cached->rsp);
+            ubt_rpc_send_ack(rpc, message, cached->ctrl, cached->cmd, cached->err, cached->rsp, true);
+        } else {
+            RPC_TRACE_MSG(RPC_TRACE_INFO, RPC_EV_DUP_DROP, &message->base, 0);
+        }
+        ubt_rpc_message_free(message);
+        return;
+    }
+#endif
 
-    if (MSG_IS_NOTIFY(message)) {
-        if (message->rpc->notify_handler) {
-            message->rpc->notify_handler(message);
+    if (MSG_IS_NOTIFY(&message->base)) {
+        if (rpc->notify_handler) {
+            rpc->notify_handler(message);
+        }
+        if (MSG_NEED_NOTI_ACK(&message->base)) {
+            ubt_rpc_send_ack(rpc, message, ATTR_NOTI_ACK, message->base.cmd, 0, NULL, false);
         }
     } else {
-        if (message->rpc->request_handler) {
-            void *rv = message->rpc->request_handler(message);
+        if (rpc->request_handler) {
+            void *rv;
+#ifdef RPC_BATCH_SUPPORT
+            if (MSG_IS_REQ(&message->base) && message->base.cmd == RPC_CMD_BATCH) {
+                rv = ubt_rpc_batch_dispatch(message);
+            } else
+#endif
+            {
+                rv = rpc->request_handler(message);
+            }
             if (rv) {
-                //uint8_t attr = message->attr == Header_Attr_REQUEST ? Header_Attr_REQACK : Header_Attr_PUBACK;
-                //ubt_rpc_perform_ack(message->rpc, message->dev, message->cmd, message->id, message->seq, attr, message->ack_code, rv);
-                rpc_request_config_t req_conf = {
-                    .retry = 0,
-                    .err = 0,
-                    .ctrl = ATTR_REQ_ACK,
-                    .expect_ack = false,
-                    .cmd = message->cmd + 1,
-                    .timeout = 0,
-                    .seq = message->seq,
-                };
-                ubt_rpc_perform(message->rpc, &req_conf, rv);
+#ifdef RPC_DEDUP_SUPPORT
+                if (peer) {
+                    ubt_rpc_dedup_store(rpc, peer, message->base.seq, message->base.cmd + 1, ATTR_REQ_ACK, 0, rv);
+                    ubt_rpc_send_ack(rpc, message, ATTR_REQ_ACK, message->base.cmd + 1, 0, rv, true);
+                } else
+#endif
+                {
+                    ubt_rpc_send_ack(rpc, message, ATTR_REQ_ACK, message->base.cmd + 1, 0, rv, false);
+                }
             }
         }
     }
@@ -137,11 +497,48 @@ static void ubt_rpc_handle_input_message(threadpool_t *pool, void *context)
 }
 #endif
 
+#ifdef RPC_STREAM_SUPPORT
+#define MSG_TO_PENDING(msg) (MSG_IS_ACK(msg) || MSG_IS_STREAM(msg))
+#define MSG_IS_PROBE(msg) ((((msg)->ctrl&0x1F) == ATTR_RSP_ACK) && ((msg)->ctrl & ATTR_FLAG_PROBE))
+#define MSG_IS_FIN(msg) ((((msg)->ctrl&0x1F) == ATTR_RSP_REQ) && ((msg)->ctrl & ATTR_FLAG_FIN))
+static void ubt_rpc_stream_credit(ubt_rpc_stream_t *stream, uint8_t done);
+static int ubt_rpc_stream_output(ubt_rpc_stream_t *stream, uint8_t ctrl, uint8_t err, void *param);
+#else
+#define MSG_TO_PENDING(msg) MSG_IS_ACK(msg)
+#endif
+
+static bool ubt_rpc_pending_match(ubt_rpc_request_t *iter, rpc_message_t *message)
+{
+    if (iter->base.seq != message->base.seq) {
+        return false;
+    }
+#ifdef RPC_STREAM_SUPPORT
+    /*
+     * chunks and credits only go to streams, an established stream takes nothing else.
+     * Both ends may have a slot of one seq, the frame goes to the other side's slot for its sender.
+     */
+    if (MSG_IS_STREAM(&message->base)) {
+        if (iter->stream == NULL || !(message->base.ctrl & ATTR_FLAG_ACCEPT) != iter->stream->acceptor) {
+            return false;
+        }
+#ifdef RPC_ADDRESS_SUPPORT
+        return message->base.src == iter->base.dst;
+#else
+        return true;
+#endif
+    }
+    if (iter->stream && iter->stream->established) {
+        return false;
+    }
+#endif
+    return true;
+}
+
 static int ubt_rpc_dispatch(ubt_rpc_t *rpc, rpc_message_t *message)
 {
-	RPC_LOG_D("freesize1:%d", rpc_get_freeheap_size());
     ubt_rpc_request_t *iter, *tmp;
-    if (!MSG_IS_ACK(message)) {
+    RPC_TRACE_MSG(RPC_TRACE_INFO, RPC_EV_DISPATCH, &message->base, message);
+    if (!MSG_TO_PENDING(&message->base)) {
 #if RPC_TX_STANDALONE_THREAD
 		ubt_rpc_handle_input_message(message);
 #else
@@ -149,23 +546,56 @@ static int ubt_rpc_dispatch(ubt_rpc_t *rpc, rpc_message_t *message)
 #error user's impl  ubt_rpc_handle_input_message()
 
 #endif
-    } else if (MSG_IS_ACK(message)) {
+    } else if (MSG_TO_PENDING(&message->base)) {
+        bool delivered = false;
         ubt_rpc_impl_lock(rpc);
         if (!list_empty(&rpc->wait_response_head)) {
             list_for_each_entry_safe(iter, tmp, &rpc->wait_response_head, list) {
-                if (iter->request_id == message->seq) {
-                    if (osMessageQueuePut(iter->queue, &message, 0, 0) == osOK) {
+                if (ubt_rpc_pending_match(iter, message)) {
+#ifdef RPC_STREAM_SUPPORT
+                    if ((message->base.ctrl & 0x1F) == ATTR_RSP_ACK && !MSG_IS_PROBE(&message->base)) {
+                        ubt_rpc_stream_credit(iter->stream, message->base.err);
+                        break;
+                    }
+                    /* one probe in the queue is enough, it must not take the room of the FIN */
+                    if (MSG_IS_PROBE(&message->base) && iter->stream->probe_queued) {
+                        break;
+                    }
+                    if (MSG_IS_FIN(&message->base)) {
+                        /* answer every FIN until this side closes, a lost answer is made up by the retransmit */
+                        if (!iter->stream->closing) {
+                            ubt_rpc_stream_output(iter->stream, ATTR_RSP_REQ | ATTR_FLAG_FIN, message->base.err, NULL);
+                        }
+                        if (iter->stream->fin_queued) {
+                            break;
+                        }
+                    }
+#endif
+                    if (iter->queue && osMessageQueuePut(iter->queue, &message, 0, 0) == osOK) {
+                        delivered = true;
+#ifdef RPC_STREAM_SUPPORT
+                        if (MSG_IS_PROBE(&message->base)) {
+                            iter->stream->probe_queued = true;
+                        }
+                        if (MSG_IS_FIN(&message->base)) {
+                            iter->stream->fin_queued = true;
+                        }
+#endif
                     }
                     break;
                 }
             }   
         }
         ubt_rpc_impl_unlock(rpc);
+        if (!delivered) {
+            /* late or duplicate ACK of a retransmitted request, stream credit or overrun chunk */
+            RPC_TRACE_MSG(RPC_TRACE_DBG, RPC_EV_ACK_DROP, &message->base, message);
+            ubt_rpc_message_free(message);
+        }
     } else {
         RPC_LOG_D("message type is not support");
         rpc_assert(0);
     }
-	RPC_LOG_D("freesize2:%d", rpc_get_freeheap_size());
     return 0;
 }
 
@@ -198,20 +628,24 @@ static void message_callback(void *pb_codec)
 
 static void ubt_rpc_request_destroy(ubt_rpc_t *rpc, ubt_rpc_request_t *request)
 {
-    RPC_LOG_D("ubt_rpc_request_destroy %p", request);
+    rpc_message_t *message = NULL;
+    RPC_TRACE_MSG(RPC_TRACE_DBG, RPC_EV_REQ_FREE, &request->base, request);
     ubt_rpc_impl_lock(rpc);
     list_del(&request->list);
-    if (rpc->active_request) {
+    if (request->queue && rpc->active_request) {
         rpc->active_request--;
     }
     ubt_rpc_impl_unlock(rpc);
     if(request->queue){
-        osMessageQueueDelete(request->queue);
+        while (osMessageQueueGet(request->queue, &message, NULL, 0) == osOK) {
+            ubt_rpc_message_free(message);
+        }
+        ubt_rpc_queue_release(rpc, request->queue);
     }
     if (request->data_buf) {
-        rpc_free(request->data_buf);
+        RPC_FREE(rpc, buf_pool, request->data_buf);
     }
-    rpc_free(request);
+    RPC_FREE(rpc, req_pool, request);
 }
 
 static void ubt_rpc_process_output(ubt_rpc_t *rpc)
@@ -259,118 +693,498 @@ static void rpc_tx_runner(void *arg)
 }
 #endif
 
-ubt_rpc_t *ubt_rpc_create(ubt_rpc_config_t *config)
+typedef struct {
+    uint16_t max_request;
+    uint32_t buffer_size;
+    uint32_t stack_size;
+} rpc_sizing_t;
+
+static void ubt_rpc_config_sizing(const ubt_rpc_config_t *config, rpc_sizing_t *sz)
 {
-    rpc_assert(config);
-    rpc_assert(config->task_stack_size < 8192);
-    uint32_t stack_size = config->task_stack_size;
-    uint32_t buffer_size = config->buffer_size;
-    ubt_rpc_t *rpc = (ubt_rpc_t *)rpc_malloc(sizeof(ubt_rpc_t));
-    if (!rpc) {
-        return NULL;
-    }
-    memset(rpc, 0, sizeof(ubt_rpc_t));
-    rpc->poll_sem = osSemaphoreNew(0xFFFFFFFF, 0, NULL);
-    list_init(&rpc->call_list_head);
-    list_init(&rpc->wait_response_head);
     if (config->max_request == 0 || config->max_request > RPC_MAX_CONCURRENT) {
-        rpc->max_request = RPC_MAX_CONCURRENT;
+        sz->max_request = RPC_MAX_CONCURRENT;
     } else {
-        rpc->max_request = config->max_request;
+        sz->max_request = config->max_request;
     }
+    sz->stack_size = config->task_stack_size ? config->task_stack_size : 4096;
+    sz->buffer_size = config->buffer_size ? config->buffer_size : 256;
+}
 
-    if (stack_size == 0) {
-        stack_size = 4096;
-    }
-    if (0 == buffer_size) {
-        buffer_size = 256;
-    }
-    rpc->buffer_size = buffer_size;
-    rpc->notify_handler = config->notify_handler;
-    rpc->request_handler = config->request_handler;
-    // rpc->pb_codec = ubt_rpc_codec_create((void *)rpc);
-    // if (!rpc->pb_codec) {
-    //     rpc_free(rpc);
-    //     return NULL;
-    // }
+#ifdef RPC_STATIC_MEMORY
+typedef struct {
+    uint8_t *base;      // NULL: only measure
+    uint32_t used;
+} rpc_arena_t;
 
-    // ubt_rpc_codec_set_transport(rpc->pb_codec, &config->transport);
-    // ubt_rpc_codec_set_on_message_callback(rpc->pb_codec, message_callback);
+typedef struct {
+    ubt_rpc_t *rpc;
+    void *mutex_cb;
+    void *poll_sem_cb;
+    void *rx_cb;
+    void *rx_stack;
+#ifdef RPC_TX_STANDALONE_THREAD
+    void *tx_sem_cb;
+    void *tx_cb;
+    void *tx_stack;
+#endif
+    uint8_t *req_mem;
+    uint8_t *buf_mem;
+    uint8_t *msg_mem;
+    uint8_t *param_mem;
+#ifdef RPC_STREAM_SUPPORT
+    uint8_t *stream_mem;
+#endif
+    uint8_t *queue_cb;
+    uint8_t *queue_mem;
+    osMessageQueueId_t *queue_pool;
+#ifdef RPC_LZ_SUPPORT
+    void *lz_mutex_cb;
+    uint16_t *lz_hash;
+    uint8_t *lz_buf;
+#endif
+} rpc_static_layout_t;
 
-    const osThreadAttr_t thread_attr = {
-        .name = "rx",
-        .attr_bits = 0,
-        .cb_mem = NULL,
-        .cb_size = 0,
-        .stack_mem = NULL,
-        .stack_size = stack_size,
-        .priority = osPriorityBelowNormal1,
-        .tz_module = 0,
-        .reserved = 0
-    };
+#define RPC_STATIC_REQUESTS(sz)     ((sz)->max_request + RPC_STATIC_TX_FRAMES)
+#define RPC_STATIC_REQ_BLOCK        RPC_ALIGN(sizeof(ubt_rpc_request_t))
+#define RPC_STATIC_MSG_BLOCK        RPC_ALIGN(sizeof(rpc_message_t))
+#define RPC_STATIC_STREAM_BLOCK     (RPC_ALIGN(sizeof(ubt_rpc_stream_t)) + RPC_ALIGN(RPC_OS_SEMAPHORE_CB_SIZE))
+#define RPC_STATIC_MQ_CB_BLOCK      RPC_ALIGN(RPC_OS_MQ_CB_SIZE)
+#define RPC_STATIC_MQ_MEM_BLOCK     RPC_ALIGN(RPC_OS_MQ_MEM_SIZE(RPC_STATIC_QUEUE_DEPTH, sizeof(rpc_message_t *)))
+#ifdef RPC_DEDUP_SUPPORT
+#define RPC_STATIC_PARAM_COUNT      (RPC_STATIC_PARAMS + RPC_DEDUP_MAX_PEER * RPC_DEDUP_RSP_CACHE)
+#else
+#define RPC_STATIC_PARAM_COUNT      RPC_STATIC_PARAMS
+#endif
 
-    rpc->thread_id =  osThreadNew(rpc_runner, rpc, &thread_attr);
-    if (!rpc->thread_id) {
-        ubt_rpc_codec_destroy(rpc->pb_codec);
-        rpc_free(rpc);
-        rpc = NULL;
-    }
-#if RPC_TX_STANDALONE_THREAD
-    const osThreadAttr_t thread_tx_attr = {
-        .name = "tx",
-        .attr_bits = 0,
-        .cb_mem = NULL,
-        .cb_size = 0,
-        .stack_mem = NULL,
-        .stack_size = stack_size,
-        .priority = osPriorityBelowNormal,
-        .tz_module = 0,
-        .reserved = 0
-    };	
-	rpc->tx_thread = osThreadNew(rpc_tx_runner, rpc, &thread_tx_attr);
-    if (!rpc->tx_thread) {
-		osThreadTerminate(rpc->thread_id);
-        ubt_rpc_codec_destroy(rpc->pb_codec);
-        rpc_free(rpc);
-        rpc = NULL;
+static uint32_t ubt_rpc_param_block(const rpc_sizing_t *sz)
+{
+    uint32_t size = sz->buffer_size;
+#ifdef RPC_BATCH_SUPPORT
+    if (size < sizeof(rpc_batch_t)) {
+        size = sizeof(rpc_batch_t);
     }
-	rpc->tx_sem = osSemaphoreNew(0xFFFFFFFF, 0, NULL);
 #endif
-    return rpc;
+    return RPC_ALIGN(size);
 }
 
-void ubt_rpc_destroy(ubt_rpc_t *rpc)
+static void *ubt_rpc_arena_take(rpc_arena_t *arena, uint32_t size)
 {
-    osMutexDelete(rpc->mutex);
-    // ubt_rpc_codec_destroy(rpc->pb_codec);
-    osThreadTerminate(rpc->thread_id);
-    rpc_free(rpc);
+    void *p;
+    arena->used = RPC_ALIGN(arena->used);
+    p = arena->base ? arena->base + arena->used : NULL;
+    arena->used += size;
+    return p;
 }
 
-// static ubt_err_t ubt_rpc_encode_header(ubt_rpc_t *rpc, ubt_rpc_request_t *request, rpc_request_config_t *req_conf, common_message *pkt)
-// {
-//     uint32_t frame_len = 0;
-
-//     if(request->data_len > sizeof(pkt->body.bytes)){
-//         return UBT_ERR_NO_MEM;
-//     }
+/* carve every object the instance will ever use, in one fixed order */
+static void ubt_rpc_arena_layout(rpc_arena_t *arena, const rpc_sizing_t *sz, rpc_static_layout_t *lay)
+{
+    lay->rpc = ubt_rpc_arena_take(arena, sizeof(ubt_rpc_t));
+    lay->mutex_cb = ubt_rpc_arena_take(arena, RPC_OS_MUTEX_CB_SIZE);
+    lay->poll_sem_cb = ubt_rpc_arena_take(arena, RPC_OS_SEMAPHORE_CB_SIZE);
+    lay->rx_cb = ubt_rpc_arena_take(arena, RPC_OS_THREAD_CB_SIZE);
+    lay->rx_stack = ubt_rpc_arena_take(arena, sz->stack_size);
+#ifdef RPC_TX_STANDALONE_THREAD
+    lay->tx_sem_cb = ubt_rpc_arena_take(arena, RPC_OS_SEMAPHORE_CB_SIZE);
+    lay->tx_cb = ubt_rpc_arena_take(arena, RPC_OS_THREAD_CB_SIZE);
+    lay->tx_stack = ubt_rpc_arena_take(arena, sz->stack_size);
+#endif
+    lay->req_mem = ubt_rpc_arena_take(arena, RPC_STATIC_REQUESTS(sz) * RPC_STATIC_REQ_BLOCK);
+    lay->buf_mem = ubt_rpc_arena_take(arena, RPC_STATIC_REQUESTS(sz) * RPC_ALIGN(sz->buffer_size));
+    lay->msg_mem = ubt_rpc_arena_take(arena, RPC_STATIC_RX_MESSAGES * RPC_STATIC_MSG_BLOCK);
+    lay->param_mem = ubt_rpc_arena_take(arena, RPC_STATIC_PARAM_COUNT * ubt_rpc_param_block(sz));
+#ifdef RPC_STREAM_SUPPORT
+    lay->stream_mem = ubt_rpc_arena_take(arena, sz->max_request * RPC_STATIC_STREAM_BLOCK);
+#endif
+    lay->queue_cb = ubt_rpc_arena_take(arena, sz->max_request * RPC_STATIC_MQ_CB_BLOCK);
+    lay->queue_mem = ubt_rpc_arena_take(arena, sz->max_request * RPC_STATIC_MQ_MEM_BLOCK);
+    lay->queue_pool = ubt_rpc_arena_take(arena, sz->max_request * sizeof(osMessageQueueId_t));
+#ifdef RPC_LZ_SUPPORT
+    lay->lz_mutex_cb = ubt_rpc_arena_take(arena, RPC_OS_MUTEX_CB_SIZE);
+    lay->lz_hash = ubt_rpc_arena_take(arena, RPC_LZ_HASH_SIZE);
+    lay->lz_buf = ubt_rpc_arena_take(arena, sz->buffer_size);
+#endif
+}
 
-//     //memcpy(pkt->body.bytes, request->data_buf, request->data_len);
-//     //pkt->body.size = request->data_len;
+uint32_t ubt_rpc_arena_size(const ubt_rpc_config_t *config)
+{
+    rpc_sizing_t sz;
+    rpc_static_layout_t lay;
+    rpc_arena_t arena = { NULL, 0 };
 
-//     //header encode
-//     pb_ostream_t stream = pb_ostream_from_buffer ( request->data_buf + 2, request->data_len - 3);
-//     if ( !pb_encode ( &stream, common_message_fields, pkt ) ) {
-//         ubt_log_error(TAG, "pb encode common_message_fields failed\n");
-//         return UBT_ERR_PARAM;
-//     }
+    ubt_rpc_config_sizing(config, &sz);
+    ubt_rpc_arena_layout(&arena, &sz, &lay);
+    return arena.used;
+}
 
-//     if (stream.bytes_written == 0) {
-//         ubt_log_error(TAG, "payload len == 0\n");
-//         return UBT_ERR_NO_MEM;
-//     }
+static int ubt_rpc_static_init(ubt_rpc_t *rpc, const rpc_sizing_t *sz, rpc_static_layout_t *lay)
+{
+    const osMutexAttr_t mutex_attr = {
+        .name = NULL,
+        .attr_bits = osMutexRecursive,
+        .cb_mem = lay->mutex_cb,
+        .cb_size = RPC_OS_MUTEX_CB_SIZE
+    };
+    osMessageQueueAttr_t queue_attr = {
+        .name = NULL,
+        .attr_bits = 0,
+        .cb_size = RPC_STATIC_MQ_CB_BLOCK,
+        .mq_size = RPC_STATIC_MQ_MEM_BLOCK
+    };
+    osMessageQueueId_t queue;
+    uint16_t i;
 
-//     request->data_buf[frame_len++] = FRAME_HEAD;
+    rpc->mutex = osMutexNew(&mutex_attr);
+    if (!rpc->mutex) {
+        return -1;
+    }
+    ubt_rpc_pool_init(&rpc->req_pool, lay->req_mem, RPC_STATIC_REQ_BLOCK, RPC_STATIC_REQUESTS(sz));
+    ubt_rpc_pool_init(&rpc->buf_pool, lay->buf_mem, RPC_ALIGN(sz->buffer_size), RPC_STATIC_REQUESTS(sz));
+    ubt_rpc_pool_init(&rpc->msg_pool, lay->msg_mem, RPC_STATIC_MSG_BLOCK, RPC_STATIC_RX_MESSAGES);
+    ubt_rpc_pool_init(&rpc->param_pool, lay->param_mem, ubt_rpc_param_block(sz), RPC_STATIC_PARAM_COUNT);
+#ifdef RPC_STREAM_SUPPORT
+    ubt_rpc_pool_init(&rpc->stream_pool, lay->stream_mem, RPC_STATIC_STREAM_BLOCK, sz->max_request);
+#endif
+    rpc->queue_pool = lay->queue_pool;
+    for (i = 0; i < sz->max_request; i++) {
+        queue_attr.cb_mem = lay->queue_cb + i * RPC_STATIC_MQ_CB_BLOCK;
+        queue_attr.mq_mem = lay->queue_mem + i * RPC_STATIC_MQ_MEM_BLOCK;
+        queue = osMessageQueueNew(RPC_STATIC_QUEUE_DEPTH, sizeof(rpc_message_t *), &queue_attr);
+        if (!queue) {
+            return -1;
+        }
+        rpc->queue_pool[rpc->queue_idle++] = queue;
+    }
+#ifdef RPC_LZ_SUPPORT
+    const osMutexAttr_t lz_mutex_attr = {
+        .name = NULL,
+        .attr_bits = 0,
+        .cb_mem = lay->lz_mutex_cb,
+        .cb_size = RPC_OS_MUTEX_CB_SIZE
+    };
+    rpc->lz_mutex = osMutexNew(&lz_mutex_attr);
+    if (!rpc->lz_mutex) {
+        return -1;
+    }
+    rpc->lz_hash = lay->lz_hash;
+    rpc->lz_buf = lay->lz_buf;
+#endif
+    return 0;
+}
+#endif
+
+static void ubt_rpc_release(ubt_rpc_t *rpc)
+{
+#ifdef RPC_TX_STANDALONE_THREAD
+    if (rpc->tx_thread) {
+        osThreadTerminate(rpc->tx_thread);
+        ubt_rpc_trace_release(rpc->tx_thread);
+    }
+    if (rpc->tx_sem) {
+        osSemaphoreDelete(rpc->tx_sem);
+    }
+#endif
+    if (rpc->thread_id) {
+        osThreadTerminate(rpc->thread_id);
+        ubt_rpc_trace_release(rpc->thread_id);
+    }
+    if (rpc->poll_sem) {
+        osSemaphoreDelete(rpc->poll_sem);
+    }
+    // ubt_rpc_codec_destroy(rpc->pb_codec);
+#ifdef RPC_STATIC_MEMORY
+    while (rpc->queue_idle) {
+        osMessageQueueDelete(rpc->queue_pool[--rpc->queue_idle]);
+    }
+#ifdef RPC_LZ_SUPPORT
+    if (rpc->lz_mutex) {
+        osMutexDelete(rpc->lz_mutex);
+    }
+#endif
+#else
+#ifdef RPC_LZ_SUPPORT
+    if (rpc->lz_mutex) {
+        osMutexDelete(rpc->lz_mutex);
+    }
+    if (rpc->lz_hash) {
+        rpc_free(rpc->lz_hash);
+    }
+    if (rpc->lz_buf) {
+        rpc_free(rpc->lz_buf);
+    }
+#endif
+#endif
+    if (rpc->mutex) {
+        osMutexDelete(rpc->mutex);
+    }
+#ifndef RPC_STATIC_MEMORY
+    rpc_free(rpc);
+#endif
+}
+
+/*
+ * With RPC_STATIC_MEMORY every object comes out of config->arena (8 byte aligned,
+ * at least ubt_rpc_arena_size(config) bytes): no heap is touched after this returns.
+ */
+ubt_rpc_t *ubt_rpc_create(ubt_rpc_config_t *config)
+{
+    rpc_assert(config);
+    rpc_assert(config->task_stack_size < 8192);
+    rpc_sizing_t sz;
+    ubt_rpc_t *rpc;
+#ifdef RPC_STATIC_MEMORY
+    rpc_static_layout_t lay;
+    rpc_arena_t arena = { (uint8_t *)config->arena, 0 };
+    osSemaphoreAttr_t sem_attr = {
+        .name = NULL,
+        .attr_bits = 0,
+        .cb_mem = NULL,
+        .cb_size = RPC_OS_SEMAPHORE_CB_SIZE
+    };
+#endif
+
+    ubt_rpc_config_sizing(config, &sz);
+#ifdef RPC_STATIC_MEMORY
+    if (config->arena == NULL || config->arena_size < ubt_rpc_arena_size(config)) {
+        RPC_LOG_D("arena too small, need %d", ubt_rpc_arena_size(config));
+        return NULL;
+    }
+    memset(config->arena, 0, config->arena_size);
+    ubt_rpc_arena_layout(&arena, &sz, &lay);
+    rpc = lay.rpc;
+#else
+    rpc = (ubt_rpc_t *)rpc_malloc(sizeof(ubt_rpc_t));
+    if (!rpc) {
+        return NULL;
+    }
+    memset(rpc, 0, sizeof(ubt_rpc_t));
+#endif
+    list_init(&rpc->call_list_head);
+    list_init(&rpc->wait_response_head);
+    rpc->max_request = sz.max_request;
+    rpc->buffer_size = sz.buffer_size;
+    rpc->notify_handler = config->notify_handler;
+    rpc->request_handler = config->request_handler;
+#ifdef RPC_DEDUP_SUPPORT
+    uint32_t seed = rpc_session_seed();
+    rpc->session = (uint8_t)(seed ^ (seed >> 8) ^ (seed >> 16) ^ (seed >> 24));
+#endif
+#ifdef RPC_STATIC_MEMORY
+    if (ubt_rpc_static_init(rpc, &sz, &lay) != 0) {
+        RPC_LOG_D("static init fail");
+        ubt_rpc_release(rpc);
+        return NULL;
+    }
+    sem_attr.cb_mem = lay.poll_sem_cb;
+    rpc->poll_sem = osSemaphoreNew(0xFFFFFFFF, 0, &sem_attr);
+#else
+    rpc->poll_sem = osSemaphoreNew(0xFFFFFFFF, 0, NULL);
+#ifdef RPC_LZ_SUPPORT
+    rpc->lz_mutex = osMutexNew(NULL);
+    rpc->lz_hash = (uint16_t *)rpc_malloc(RPC_LZ_HASH_SIZE);
+    rpc->lz_buf = (uint8_t *)rpc_malloc(sz.buffer_size);
+    if (!rpc->lz_mutex || !rpc->lz_hash || !rpc->lz_buf) {
+        RPC_LOG_D("lz arena alloc fail");
+        ubt_rpc_release(rpc);
+        return NULL;
+    }
+#endif
+#endif
+    // rpc->pb_codec = ubt_rpc_codec_create((void *)rpc);
+    // if (!rpc->pb_codec) {
+    //     rpc_free(rpc);
+    //     return NULL;
+    // }
+
+    // ubt_rpc_codec_set_transport(rpc->pb_codec, &config->transport);
+    // ubt_rpc_codec_set_on_message_callback(rpc->pb_codec, message_callback);
+
+    osThreadAttr_t thread_attr = {
+        .name = "rx",
+        .attr_bits = 0,
+        .cb_mem = NULL,
+        .cb_size = 0,
+        .stack_mem = NULL,
+        .stack_size = sz.stack_size,
+        .priority = osPriorityBelowNormal1,
+        .tz_module = 0,
+        .reserved = 0
+    };
+#ifdef RPC_STATIC_MEMORY
+    thread_attr.cb_mem = lay.rx_cb;
+    thread_attr.cb_size = RPC_OS_THREAD_CB_SIZE;
+    thread_attr.stack_mem = lay.rx_stack;
+#endif
+
+    rpc->thread_id =  osThreadNew(rpc_runner, rpc, &thread_attr);
+    if (!rpc->thread_id) {
+        ubt_rpc_release(rpc);
+        return NULL;
+    }
+#ifdef RPC_TX_STANDALONE_THREAD
+    osThreadAttr_t thread_tx_attr = {
+        .name = "tx",
+        .attr_bits = 0,
+        .cb_mem = NULL,
+        .cb_size = 0,
+        .stack_mem = NULL,
+        .stack_size = sz.stack_size,
+        .priority = osPriorityBelowNormal,
+        .tz_module = 0,
+        .reserved = 0
+    };	
+#ifdef RPC_STATIC_MEMORY
+    thread_tx_attr.cb_mem = lay.tx_cb;
+    thread_tx_attr.cb_size = RPC_OS_THREAD_CB_SIZE;
+    thread_tx_attr.stack_mem = lay.tx_stack;
+    sem_attr.cb_mem = lay.tx_sem_cb;
+	rpc->tx_sem = osSemaphoreNew(0xFFFFFFFF, 0, &sem_attr);
+#else
+	rpc->tx_sem = osSemaphoreNew(0xFFFFFFFF, 0, NULL);
+#endif
+	rpc->tx_thread = osThreadNew(rpc_tx_runner, rpc, &thread_tx_attr);
+    if (!rpc->tx_thread) {
+        ubt_rpc_release(rpc);
+        return NULL;
+    }
+#endif
+    return rpc;
+}
+
+void ubt_rpc_destroy(ubt_rpc_t *rpc)
+{
+#ifdef RPC_DEDUP_SUPPORT
+    uint8_t i;
+    for (i = 0; i < RPC_DEDUP_MAX_PEER; i++) {
+        ubt_rpc_dedup_flush(rpc, &rpc->dedup[i]);
+    }
+#endif
+    ubt_rpc_release(rpc);
+}
+
+#ifdef RPC_LZ_SUPPORT
+int ubt_rpc_set_compress(ubt_rpc_t *rpc, uint32_t cmd, bool enable)
+{
+    uint8_t i;
+    int err = 0;
+
+    ubt_rpc_impl_lock(rpc);
+    for (i = 0; i < rpc->lz_cmd_num; i++) {
+        if (rpc->lz_cmd[i] == cmd) {
+            break;
+        }
+    }
+    if (enable && i == rpc->lz_cmd_num) {
+        if (rpc->lz_cmd_num < RPC_LZ_MAX_CMD) {
+            rpc->lz_cmd[rpc->lz_cmd_num++] = cmd;
+        } else {
+            RPC_LOG_D("lz cmd table full");
+            err = -1;
+        }
+    } else if (!enable && i < rpc->lz_cmd_num) {
+        rpc->lz_cmd[i] = rpc->lz_cmd[--rpc->lz_cmd_num];
+    }
+    ubt_rpc_impl_unlock(rpc);
+    return err;
+}
+
+static bool ubt_rpc_lz_wanted(ubt_rpc_t *rpc, uint32_t cmd, uint32_t len)
+{
+    bool wanted = false;
+    uint8_t i;
+
+#if RPC_LZ_THRESHOLD > 0
+    if (len >= RPC_LZ_THRESHOLD) {
+        return true;
+    }
+#else
+    (void)len;
+#endif
+    ubt_rpc_impl_lock(rpc);
+    for (i = 0; i < rpc->lz_cmd_num; i++) {
+        if (rpc->lz_cmd[i] == cmd) {
+            wanted = true;
+            break;
+        }
+    }
+    ubt_rpc_impl_unlock(rpc);
+    return wanted;
+}
+
+/*
+ * For the codec to call between serializing the param and framing it, not wired up in
+ * this tree yet: compress the payload in place. The scratch has its own lock, so
+ * dispatch and allocation are not held up while a payload is compressed.
+ */
+void ubt_rpc_payload_compress(ubt_rpc_t *rpc, ubt_rpc_msg_base_t *base, uint8_t *payload, uint32_t *len)
+{
+    uint32_t out;
+
+    if (*len == 0 || *len > rpc->buffer_size || !ubt_rpc_lz_wanted(rpc, base->cmd, *len)) {
+        return;
+    }
+    osMutexAcquire(rpc->lz_mutex, osWaitForever);
+    /* only keep it if it actually got smaller */
+    out = ubt_rpc_lz_compress(payload, *len, rpc->lz_buf, *len - 1, rpc->lz_hash);
+    if (out) {
+        memcpy(payload, rpc->lz_buf, out);
+        *len = out;
+        base->ctrl |= ATTR_FLAG_LZ;
+    }
+    osMutexRelease(rpc->lz_mutex);
+}
+
+/* for the codec to call before unserializing: expand a compressed payload in place, -1 if it is corrupt or too big */
+int ubt_rpc_payload_decompress(ubt_rpc_t *rpc, ubt_rpc_msg_base_t *base, uint8_t *payload, uint32_t *len, uint32_t cap)
+{
+    uint32_t out;
+
+    if (!(base->ctrl & ATTR_FLAG_LZ)) {
+        return 0;
+    }
+    if (cap > rpc->buffer_size) {
+        cap = rpc->buffer_size;
+    }
+    osMutexAcquire(rpc->lz_mutex, osWaitForever);
+    out = ubt_rpc_lz_decompress(payload, *len, rpc->lz_buf, cap);
+    if (out) {
+        memcpy(payload, rpc->lz_buf, out);
+        *len = out;
+        base->ctrl &= ~ATTR_FLAG_LZ;
+    }
+    osMutexRelease(rpc->lz_mutex);
+    if (!out) {
+        RPC_LOG_D("lz payload corrupt, cmd=%d", base->cmd);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+// static ubt_err_t ubt_rpc_encode_header(ubt_rpc_t *rpc, ubt_rpc_request_t *request, rpc_request_config_t *req_conf, common_message *pkt)
+// {
+//     uint32_t frame_len = 0;
+
+//     if(request->data_len > sizeof(pkt->body.bytes)){
+//         return UBT_ERR_NO_MEM;
+//     }
+
+//     //memcpy(pkt->body.bytes, request->data_buf, request->data_len);
+//     //pkt->body.size = request->data_len;
+
+//     //header encode
+//     pb_ostream_t stream = pb_ostream_from_buffer ( request->data_buf + 2, request->data_len - 3);
+//     if ( !pb_encode ( &stream, common_message_fields, pkt ) ) {
+//         ubt_log_error(TAG, "pb encode common_message_fields failed\n");
+//         return UBT_ERR_PARAM;
+//     }
+
+//     if (stream.bytes_written == 0) {
+//         ubt_log_error(TAG, "payload len == 0\n");
+//         return UBT_ERR_NO_MEM;
+//     }
+
+//     request->data_buf[frame_len++] = FRAME_HEAD;
 //     request->data_buf[frame_len++] = stream.bytes_written;
 // 	frame_len += stream.bytes_written;
 //     request->data_buf[frame_len++] = crc8 ( request->data_buf + 2, stream.bytes_written );
@@ -399,6 +1213,32 @@ static int ubt_rpc_output_enqueue(ubt_rpc_t *rpc, ubt_rpc_request_t *request)
     return 0;
 }
 
+/*
+ * The frame is encoded before it is queued, so the caller may free or reuse param as
+ * soon as this returns: ACK params are freed right away, cached ACKs can be evicted.
+ */
+int ubt_rpc_output_cmd(ubt_rpc_t *rpc, ubt_rpc_request_t *req)
+{
+    req->data_len = rpc->buffer_size;
+    if (ubt_rpc_codec_encode(rpc, req) != 0) {
+        RPC_LOG_D("encode fail, cmd:%d seq:%d", (int)req->base.cmd, (int)req->base.seq);
+        return -1;
+    }
+    return ubt_rpc_output_enqueue(rpc, req);
+}
+
+/* put a sent request back on the call list, data_buf still holds the encoded frame */
+static void ubt_rpc_output_retransmit(ubt_rpc_t *rpc, ubt_rpc_request_t *req)
+{
+    ubt_rpc_impl_lock(rpc);
+    list_del(&req->list);
+#ifdef RPC_RTO_SUPPORT
+    req->resent = true;
+#endif
+    ubt_rpc_impl_unlock(rpc);
+    ubt_rpc_output_enqueue(rpc, req);
+}
+
 void ubt_rpc_rx_data_notify(ubt_rpc_t *rpc)
 {
     if (rpc && rpc->poll_sem) {
@@ -406,73 +1246,236 @@ void ubt_rpc_rx_data_notify(ubt_rpc_t *rpc)
     }
 }
 
-static void *ubt_rpc_wait_response(ubt_rpc_t *rpc, ubt_rpc_request_t *request)
+#ifdef RPC_RTO_SUPPORT
+/* estimator of (dst, cmd class), a new one starts from the peer's estimate of another cmd */
+static rpc_rto_t *ubt_rpc_rto_entry(ubt_rpc_t *rpc, ubt_rpc_msg_base_t *base)
 {
-    rpc_message_t *message = NULL;
-    void *rv = NULL;
-    if (osMessageQueueGet(request->queue, &message, NULL, UBT_RPC_DEFAULT_WAIT_TIMEOUT / portTICK_PERIOD_MS) == osOK) {
-        if (message->cmd != request->cmd) {
-            RPC_LOG_D("response no match, req_cmd=%d, rcv_cmd=%d", request->cmd, message->cmd);
-            ubt_rpc_message_free(message);
-        } else {
-            rv = message->struct_data;
-            RPC_LOG_D("response match, req_cmd=%d", message->cmd);
-            rpc_free(message);
+    rpc_rto_t *entry = NULL;
+    rpc_rto_t *peer = NULL;
+    uint32_t cmd = rpc_rto_class(base->cmd);
+    uint8_t dst = 0;
+    uint8_t i;
+
+#ifdef RPC_ADDRESS_SUPPORT
+    dst = base->dst;
+#endif
+    for (i = 0; i < RPC_RTO_ENTRIES; i++) {
+        if (!rpc->rto[i].valid) {
+            if (entry == NULL) {
+                entry = &rpc->rto[i];
+            }
+            continue;
+        }
+#ifdef RPC_ADDRESS_SUPPORT
+        if (rpc->rto[i].dst != dst) {
+            continue;
+        }
+#endif
+        if (rpc->rto[i].cmd == cmd) {
+            return &rpc->rto[i];
+        }
+        if (rpc->rto[i].sampled && peer == NULL) {
+            peer = &rpc->rto[i];
         }
+    }
+    if (entry == NULL) {
+        entry = &rpc->rto[rpc->rto_victim];
+        rpc->rto_victim = (rpc->rto_victim + 1) % RPC_RTO_ENTRIES;
+    }
+    if (peer && peer != entry) {
+        *entry = *peer;
+        entry->backoff = 0;
     } else {
-        RPC_LOG_D("cmd %d wait respone timeout\n", request->cmd);
+        memset(entry, 0, sizeof(rpc_rto_t));
     }
-    return rv;
+    entry->valid = true;
+#ifdef RPC_ADDRESS_SUPPORT
+    entry->dst = dst;
+#endif
+    entry->cmd = cmd;
+    (void)dst;
+    return entry;
 }
 
-void *ubt_rpc_perform(ubt_rpc_t *rpc, rpc_request_config_t *req_conf, void *param)
+static uint32_t ubt_rpc_rto_get(ubt_rpc_t *rpc, ubt_rpc_msg_base_t *base)
+{
+    rpc_rto_t *entry;
+    uint32_t rto = RPC_RTO_INIT;
+    uint8_t i;
+
+    ubt_rpc_impl_lock(rpc);
+    entry = ubt_rpc_rto_entry(rpc, base);
+    if (entry->sampled) {
+        /* srtt + max(G, 4 * rttvar), one tick of clock granularity */
+        rto = (entry->srtt >> 3) + (entry->rttvar > 1 ? entry->rttvar : 1);
+    }
+    for (i = 0; i < entry->backoff && rto < RPC_RTO_MAX; i++) {
+        rto <<= 1;
+    }
+    ubt_rpc_impl_unlock(rpc);
+    if (rto < RPC_RTO_MIN) {
+        rto = RPC_RTO_MIN;
+    }
+    return rto > RPC_RTO_MAX ? RPC_RTO_MAX : rto;
+}
+
+static void ubt_rpc_rto_backoff(ubt_rpc_t *rpc, ubt_rpc_msg_base_t *base)
+{
+    rpc_rto_t *entry;
+
+    ubt_rpc_impl_lock(rpc);
+    entry = ubt_rpc_rto_entry(rpc, base);
+    if ((RPC_RTO_MIN << entry->backoff) < RPC_RTO_MAX) {
+        entry->backoff++;
+    }
+    ubt_rpc_impl_unlock(rpc);
+}
+
+/* Karn: only requests answered without a retransmit give a sample */
+static void ubt_rpc_rto_sample(ubt_rpc_t *rpc, ubt_rpc_request_t *req)
+{
+    rpc_rto_t *entry;
+    int32_t rtt;
+    int32_t delta;
+
+    if (req->resent) {
+        return;
+    }
+    /* the estimator works in ms like every timeout, ticks are converted as in the waits */
+    rtt = (int32_t)((osKernelGetTickCount() - req->tx_tick) * portTICK_PERIOD_MS);
+    RPC_TRACE_MSG(RPC_TRACE_DBG, RPC_EV_RTT, &req->base, rtt);
+    ubt_rpc_impl_lock(rpc);
+    entry = ubt_rpc_rto_entry(rpc, &req->base);
+    if (!entry->sampled) {
+        entry->srtt = rtt << 3;
+        entry->rttvar = rtt << 1;
+        entry->sampled = true;
+    } else {
+        /* srtt += (rtt - srtt) / 8, rttvar += (|rtt - srtt| - rttvar) / 4 */
+        delta = rtt - (entry->srtt >> 3);
+        entry->srtt += delta;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        entry->rttvar += delta - (entry->rttvar >> 2);
+    }
+    entry->backoff = 0;
+    ubt_rpc_impl_unlock(rpc);
+}
+#else
+#define ubt_rpc_rto_backoff(rpc, base)
+#define ubt_rpc_rto_sample(rpc, req)
+#endif
+
+/*
+ * Wait before the next retransmit of a request: the caller's fixed timeout, otherwise
+ * the RTO. Once no retry is left there is nothing to recover, the default is waited.
+ */
+static uint32_t ubt_rpc_retry_timeout(ubt_rpc_t *rpc, ubt_rpc_msg_base_t *base, uint32_t timeout, uint16_t retry)
+{
+    if (timeout) {
+        return timeout;
+    }
+#ifdef RPC_RTO_SUPPORT
+    if (retry) {
+        return ubt_rpc_rto_get(rpc, base);
+    }
+#endif
+    return UBT_RPC_DEFAULT_WAIT_TIMEOUT;
+}
+
+static int ubt_rpc_wait_response(ubt_rpc_t *rpc, ubt_rpc_request_t *request, uint32_t timeout, void **rv)
+{
+    rpc_message_t *message = NULL;
+    /* dispatch already matched the response by seq, its cmd is the peer's ACK cmd */
+    if (osMessageQueueGet(request->queue, &message, NULL, timeout / portTICK_PERIOD_MS) == osOK) {
+        *rv = message->struct_data;
+        RPC_TRACE_MSG(RPC_TRACE_INFO, RPC_EV_RESPONSE, &request->base, message->base.cmd);
+        RPC_FREE(rpc, msg_pool, message);
+        return 0;
+    } else {
+        RPC_TRACE_MSG(RPC_TRACE_ERR, RPC_EV_TIMEOUT, &request->base, timeout);
+    }
+    return -1;
+}
+
+static void ubt_rpc_request_setup(ubt_rpc_t *rpc, ubt_rpc_request_t *req, rpc_request_config_t *req_conf, void *param)
+{
+    if(MSG_IS_ACK(&req_conf->base)){
+        req->base.seq = req_conf->base.seq;
+    }else{
+        req->base.seq = gen_request_id(rpc);
+    }
+    req->base.cmd = req_conf->base.cmd;        
+#ifdef RPC_ADDRESS_SUPPORT
+    req->base.src = req_conf->base.src; 
+    req->base.dst = req_conf->base.dst;
+#endif 
+    req->base.ctrl = req_conf->base.ctrl; 
+    req->base.err = req_conf->base.err;
+    req->expect_ack = req_conf->expect_ack;
+    req->retry = req_conf->retry;
+    req->timeout = req_conf->timeout;
+    req->mask = req_conf->mask;
+    req->param = param;
+#ifdef RPC_RTO_SUPPORT
+    req->tx_tick = osKernelGetTickCount();
+    req->resent = false;
+#endif
+}
+
+static int ubt_rpc_perform_impl(ubt_rpc_t *rpc, rpc_request_config_t *req_conf, void *param, void **response)
 {
-    void *response = NULL;
     ubt_rpc_request_t *req = NULL;
+    uint32_t timeout;
     int err = -1;
 
 	if(rpc == NULL){
 		RPC_LOG_D("rpc no init");
-		return NULL;
+		return -1;
 	}
     if(req_conf == NULL) {
         RPC_LOG_D("req_conf==NULL");
+        return -1;
     }
     do {
-        req = ubt_rpc_create_request(rpc, req_conf->expect_ack);
+        req = ubt_rpc_create_request(rpc, req_conf->expect_ack ? 1 : 0);
         if (!req) {
             RPC_LOG_D("rpc req create fail");
             break;
         }
-        if(MSG_IS_ACK(req_conf)){
-            req->base.seq = req_conf->seq;
-        }else{
-            req->base.seq = gen_request_id(rpc);
-        }
-        req->base.cmd = req_conf->cmd;        
-#if RPC_ADDRESS_SUPPORT
-        req->base.src = req_conf->src; 
-        req->base.dest = req_conf->dst;
-#endif 
-        req->base.ctrl = req_conf->ctrl; 
-        req->base.err = req_conf->err;
-        req->expect_ack = req_conf->expect_ack;
-        req->retry = req_conf->retry;
-        req->timeout = req_conf->timeout;
-        req->param = param;
+        ubt_rpc_request_setup(rpc, req, req_conf, param);
         
-        RPC_LOG_D("perform request cmd:%d,seq:%d", req_conf->base.cmd, req->base.seq);
+        RPC_TRACE_MSG(RPC_TRACE_INFO, RPC_EV_PERFORM, &req->base, req->expect_ack);
 
-        ubt_rpc_output_cmd(rpc, req);
+        if (ubt_rpc_output_cmd(rpc, req) != 0) {
+            break;
+        }
 
         if(req_conf->expect_ack){
-            response = ubt_rpc_wait_response(rpc, req);
+            while (1) {
+                timeout = ubt_rpc_retry_timeout(rpc, &req->base, req->timeout, req->retry);
+                if ((err = ubt_rpc_wait_response(rpc, req, timeout, response)) == 0) {
+                    ubt_rpc_rto_sample(rpc, req);
+                    break;
+                }
+                if (!req->timeout) {
+                    ubt_rpc_rto_backoff(rpc, &req->base);
+                }
+                if (!req->retry) {
+                    break;
+                }
+                req->retry--;
+                RPC_TRACE_MSG(RPC_TRACE_ERR, RPC_EV_RETRANSMIT, &req->base, req->retry);
+                ubt_rpc_output_retransmit(rpc, req);
+            }
+        } else {
+            err = 0;
         }
-        err = 0;
     } while (0);
 
-    if(MSG_IS_ACK(req_conf)){
-        if(param) rpc_free(param);
+    if(MSG_IS_ACK(&req_conf->base) && !req_conf->keep_param){
+        ubt_rpc_param_free(rpc, req_conf->base.cmd, param);
     }
 
     if(req){
@@ -482,8 +1485,700 @@ void *ubt_rpc_perform(ubt_rpc_t *rpc, rpc_request_config_t *req_conf, void *para
             ubt_rpc_request_destroy (rpc, req );
         }
     }
-	if(pkt != NULL){
-		rpc_free(pkt);
-	}
+    return err;
+}
+
+void *ubt_rpc_perform(ubt_rpc_t *rpc, rpc_request_config_t *req_conf, void *param)
+{
+    void *response = NULL;
+    ubt_rpc_perform_impl(rpc, req_conf, param, &response);
     return response;
 }
+
+void *ubt_rpc_perform_request(ubt_rpc_t *rpc, uint32_t dst_dev, uint32_t id, uint32_t cmd, void *param)
+{
+    rpc_request_config_t req_conf = {
+        .base = {
+#ifdef RPC_ADDRESS_SUPPORT
+            .src = id,
+            .dst = dst_dev,
+#endif
+            .ctrl = ATTR_REQ,
+            .cmd = cmd,
+        },
+        .retry = 0,
+        .expect_ack = true,
+        .timeout = 0,
+    };
+    return ubt_rpc_perform(rpc, &req_conf, param);
+}
+
+void ubt_rpc_perform_push(ubt_rpc_t *rpc, uint32_t dst_dev, uint32_t id, uint32_t cmd, void *param, uint32_t mask)
+{
+    rpc_request_config_t req_conf = {
+        .base = {
+#ifdef RPC_ADDRESS_SUPPORT
+            .src = id,
+            .dst = dst_dev,
+#endif
+            .ctrl = ATTR_NOTIFY,
+            .cmd = cmd,
+        },
+        .retry = 0,
+        .expect_ack = false,
+        .timeout = 0,
+        .mask = mask,
+    };
+    ubt_rpc_perform(rpc, &req_conf, param);
+}
+
+/* at-least-once push, the peer answers ATTR_NOTI_ACK and drops retransmits it has already seen */
+int ubt_rpc_perform_push_reliable(ubt_rpc_t *rpc, uint32_t dst_dev, uint32_t id, uint32_t cmd, void *param, uint32_t mask, uint16_t retry)
+{
+    void *response = NULL;
+    int err;
+    rpc_request_config_t req_conf = {
+        .base = {
+#ifdef RPC_ADDRESS_SUPPORT
+            .src = id,
+            .dst = dst_dev,
+#endif
+            .ctrl = ATTR_NOTIFY | ATTR_FLAG_ACK,
+            .cmd = cmd,
+        },
+        .retry = retry,
+        .expect_ack = true,
+        .timeout = 0,
+        .mask = mask,
+    };
+    err = ubt_rpc_perform_impl(rpc, &req_conf, param, &response);
+    if (response) {
+        RPC_FREE(rpc, param_pool, response);
+    }
+    return err;
+}
+
+#ifdef RPC_BATCH_SUPPORT
+/*
+ * Pack calls[i].conf.base.cmd / calls[i].param into one frame, answered by one ACK.
+ * req_conf supplies the address, retry and timeout of the frame. On return
+ * calls[i].response and calls[i].status (the per sub-request err) are filled.
+ */
+int ubt_rpc_perform_batch(ubt_rpc_t *rpc, rpc_request_config_t *req_conf, ubt_rpc_call_t *calls, uint16_t count)
+{
+    rpc_request_config_t batch_conf;
+    rpc_batch_t *batch;
+    rpc_batch_t *rsp = NULL;
+    uint16_t i;
+    int err;
+
+    if (rpc == NULL || req_conf == NULL || calls == NULL || count == 0 || count > RPC_BATCH_MAX_ITEMS) {
+        return -1;
+    }
+    batch = (rpc_batch_t *)RPC_ALLOC(rpc, param_pool, sizeof(rpc_batch_t));
+    if (!batch) {
+        return -1;
+    }
+    memset(batch, 0, sizeof(rpc_batch_t));
+    batch->count = count;
+    for (i = 0; i < count; i++) {
+        batch->item[i].cmd = calls[i].conf.base.cmd;
+        batch->item[i].data = calls[i].param;
+        calls[i].response = NULL;
+        calls[i].status = -1;
+    }
+
+    batch_conf = *req_conf;
+    batch_conf.base.ctrl = ATTR_REQ;
+    batch_conf.base.cmd = RPC_CMD_BATCH;
+    batch_conf.expect_ack = true;
+    err = ubt_rpc_perform_impl(rpc, &batch_conf, batch, (void **)&rsp);
+    /* item data still belongs to the caller */
+    RPC_FREE(rpc, param_pool, batch);
+
+    if (rsp) {
+        for (i = 0; i < count && i < rsp->count; i++) {
+            calls[i].response = rsp->item[i].data;
+            calls[i].status = rsp->item[i].err;
+        }
+        for (; i < rsp->count && i < RPC_BATCH_MAX_ITEMS; i++) {
+            if (rsp->item[i].data) {
+                RPC_FREE(rpc, param_pool, rsp->item[i].data);
+            }
+        }
+        RPC_FREE(rpc, param_pool, rsp);
+    }
+    return err;
+}
+#endif
+
+/*
+ * Pipelining: every call of a pipeline shares one completion queue (one slot of
+ * max_request), so responses are collected in arrival order and matched by seq only.
+ */
+int ubt_rpc_pipeline_submit(ubt_rpc_t *rpc, ubt_rpc_pipeline_t *pl, ubt_rpc_call_t *calls, uint16_t count)
+{
+    ubt_rpc_request_t *req;
+    uint16_t i;
+
+    if (rpc == NULL || pl == NULL || calls == NULL || count == 0) {
+        return -1;
+    }
+    memset(pl, 0, sizeof(ubt_rpc_pipeline_t));
+    pl->rpc = rpc;
+    pl->calls = calls;
+    pl->queue = get_queue_for_request(rpc, count);
+    if (!pl->queue) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        calls[i].req = NULL;
+        calls[i].response = NULL;
+        calls[i].status = -1;
+    }
+    for (i = 0; i < count; i++) {
+        req = ubt_rpc_create_request(rpc, 0);
+        if (!req) {
+            RPC_LOG_D("pipeline req create fail, %d of %d submitted", i, count);
+            break;
+        }
+        ubt_rpc_request_setup(rpc, req, &calls[i].conf, calls[i].param);
+        req->expect_ack = true;
+        req->queue = pl->queue;
+        if (ubt_rpc_output_cmd(rpc, req) != 0) {
+            req->queue = NULL;
+            ubt_rpc_request_destroy(rpc, req);
+            break;
+        }
+        calls[i].req = req;
+    }
+    pl->count = i;
+    pl->outstanding = i;
+    if (i == 0) {
+        /* nothing went out: give the queue and its max_request slot back */
+        ubt_rpc_pipeline_release(pl);
+        return -1;
+    }
+    return 0;
+}
+
+static void ubt_rpc_pipeline_finish(ubt_rpc_pipeline_t *pl, ubt_rpc_call_t *call)
+{
+    /* the queue belongs to the pipeline */
+    call->req->queue = NULL;
+    ubt_rpc_request_destroy(pl->rpc, call->req);
+    call->req = NULL;
+    pl->outstanding--;
+}
+
+/* the slowest outstanding call sets the pace, so none of them is retransmitted early; conf.timeout overrides the RTO per call */
+static uint32_t ubt_rpc_pipeline_timeout(ubt_rpc_pipeline_t *pl)
+{
+    ubt_rpc_request_t *req;
+    uint32_t timeout = 0;
+    uint32_t t;
+    uint16_t i;
+
+    for (i = 0; i < pl->count; i++) {
+        req = pl->calls[i].req;
+        if (req) {
+            t = ubt_rpc_retry_timeout(pl->rpc, &req->base, req->timeout, req->retry);
+            timeout = t > timeout ? t : timeout;
+        }
+    }
+    return timeout;
+}
+
+#ifdef RPC_RTO_SUPPORT
+/* a timeout backs off every estimator once, however many outstanding calls share it; fixed timeouts have none */
+static void ubt_rpc_pipeline_backoff(ubt_rpc_pipeline_t *pl)
+{
+    ubt_rpc_request_t *req;
+    ubt_rpc_request_t *prev;
+    uint16_t i, j;
+
+    for (i = 0; i < pl->count; i++) {
+        req = pl->calls[i].req;
+        if (!req || req->timeout) {
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            prev = pl->calls[j].req;
+            if (prev && !prev->timeout && rpc_rto_class(prev->base.cmd) == rpc_rto_class(req->base.cmd)
+#ifdef RPC_ADDRESS_SUPPORT
+                && prev->base.dst == req->base.dst
+#endif
+                ) {
+                break;
+            }
+        }
+        if (j == i) {
+            ubt_rpc_rto_backoff(pl->rpc, &req->base);
+        }
+    }
+}
+#else
+#define ubt_rpc_pipeline_backoff(pl)
+#endif
+
+/*
+ * return the index of the next completed call, -1 once nothing is left or on timeout without retry.
+ * timeout 0 waits for the outstanding calls: their conf.timeout, or the RTO where that is 0.
+ */
+int ubt_rpc_pipeline_wait(ubt_rpc_pipeline_t *pl, uint32_t timeout)
+{
+    rpc_message_t *message = NULL;
+    ubt_rpc_call_t *call;
+    uint32_t wait;
+    bool resent;
+    uint16_t i;
+
+    if (pl == NULL || pl->queue == NULL) {
+        return -1;
+    }
+    while (pl->outstanding) {
+        wait = timeout ? timeout : ubt_rpc_pipeline_timeout(pl);
+        if (osMessageQueueGet(pl->queue, &message, NULL, wait / portTICK_PERIOD_MS) != osOK) {
+            if (!timeout) {
+                ubt_rpc_pipeline_backoff(pl);
+            }
+            resent = false;
+            for (i = 0; i < pl->count; i++) {
+                call = &pl->calls[i];
+                if (call->req && call->req->retry) {
+                    call->req->retry--;
+                    RPC_TRACE_MSG(RPC_TRACE_ERR, RPC_EV_RETRANSMIT, &call->req->base, call->req->retry);
+                    ubt_rpc_output_retransmit(pl->rpc, call->req);
+                    resent = true;
+                }
+            }
+            if (!resent) {
+                RPC_LOG_D("pipeline timeout, %d outstanding", pl->outstanding);
+                return -1;
+            }
+            continue;
+        }
+        for (i = 0; i < pl->count; i++) {
+            call = &pl->calls[i];
+            if (call->req && call->req->base.seq == message->base.seq) {
+                call->response = message->struct_data;
+                call->status = message->base.err;
+                RPC_FREE(pl->rpc, msg_pool, message);
+                ubt_rpc_rto_sample(pl->rpc, call->req);
+                ubt_rpc_pipeline_finish(pl, call);
+                return i;
+            }
+        }
+        /* duplicate ACK of a call already completed */
+        ubt_rpc_message_free(message);
+    }
+    return -1;
+}
+
+void ubt_rpc_pipeline_release(ubt_rpc_pipeline_t *pl)
+{
+    rpc_message_t *message = NULL;
+    uint16_t i;
+
+    if (pl == NULL || pl->queue == NULL) {
+        return;
+    }
+    for (i = 0; i < pl->count; i++) {
+        if (pl->calls[i].req) {
+            ubt_rpc_pipeline_finish(pl, &pl->calls[i]);
+        }
+    }
+    while (osMessageQueueGet(pl->queue, &message, NULL, 0) == osOK) {
+        ubt_rpc_message_free(message);
+    }
+    ubt_rpc_queue_release(pl->rpc, pl->queue);
+    pl->queue = NULL;
+    ubt_rpc_impl_lock(pl->rpc);
+    if (pl->rpc->active_request) {
+        pl->rpc->active_request--;
+    }
+    ubt_rpc_impl_unlock(pl->rpc);
+}
+
+/* submit all calls and collect every completion, return the number of calls answered */
+int ubt_rpc_perform_pipeline(ubt_rpc_t *rpc, ubt_rpc_call_t *calls, uint16_t count)
+{
+    ubt_rpc_pipeline_t pl;
+    int done = 0;
+
+    if (ubt_rpc_pipeline_submit(rpc, &pl, calls, count) != 0) {
+        return 0;
+    }
+    while (ubt_rpc_pipeline_wait(&pl, 0) >= 0) {
+        done++;
+    }
+    ubt_rpc_pipeline_release(&pl);
+    return done;
+}
+
+#ifdef RPC_STREAM_SUPPORT
+static void ubt_rpc_stream_free(ubt_rpc_stream_t *stream)
+{
+    if (stream->slot) {
+        ubt_rpc_request_destroy(stream->rpc, stream->slot);
+    }
+    if (stream->credit) {
+        osSemaphoreDelete(stream->credit);
+    }
+    if (stream->early) {
+        ubt_rpc_message_free(stream->early);
+    }
+    RPC_FREE(stream->rpc, stream_pool, stream);
+}
+
+static ubt_rpc_stream_t *ubt_rpc_stream_alloc(ubt_rpc_t *rpc)
+{
+    ubt_rpc_stream_t *stream = (ubt_rpc_stream_t *)RPC_ALLOC(rpc, stream_pool, sizeof(ubt_rpc_stream_t));
+#ifdef RPC_STATIC_MEMORY
+    osSemaphoreAttr_t credit_attr = {
+        .name = NULL,
+        .attr_bits = 0,
+        .cb_mem = NULL,
+        .cb_size = RPC_OS_SEMAPHORE_CB_SIZE
+    };
+#endif
+    if (!stream) {
+        return NULL;
+    }
+    memset(stream, 0, sizeof(ubt_rpc_stream_t));
+    stream->rpc = rpc;
+#ifdef RPC_STATIC_MEMORY
+    /* the control block of the credit semaphore follows the stream in its pool block */
+    credit_attr.cb_mem = (uint8_t *)stream + RPC_ALIGN(sizeof(ubt_rpc_stream_t));
+    memset(credit_attr.cb_mem, 0, RPC_OS_SEMAPHORE_CB_SIZE);
+    stream->credit = osSemaphoreNew(RPC_STREAM_WINDOW, RPC_STREAM_WINDOW, &credit_attr);
+#else
+    stream->credit = osSemaphoreNew(RPC_STREAM_WINDOW, RPC_STREAM_WINDOW, NULL);
+#endif
+    /* ACK of the open, a full window of chunks and the FIN */
+    stream->slot = ubt_rpc_create_request(rpc, RPC_STREAM_WINDOW + 2);
+    if (!stream->credit || !stream->slot) {
+        RPC_LOG_D("stream create fail");
+        ubt_rpc_stream_free(stream);
+        return NULL;
+    }
+    stream->slot->stream = stream;
+    stream->slot->expect_ack = true;
+    return stream;
+}
+
+/* cumulative credit from the receiver, a stale or duplicated one changes nothing; impl lock held */
+static void ubt_rpc_stream_credit(ubt_rpc_stream_t *stream, uint8_t done)
+{
+    uint8_t n = done - stream->tx_acked;
+
+    if (n == 0 || n > (uint8_t)(stream->tx_sent - stream->tx_acked)) {
+        return;
+    }
+    stream->tx_acked = done;
+    stream->tx_tick = osKernelGetTickCount();
+    while (n--) {
+        osSemaphoreRelease(stream->credit);
+    }
+}
+
+/* chunks before num that have not come are lost: write them off and give their credit back */
+static void ubt_rpc_stream_skip(ubt_rpc_stream_t *stream, uint8_t num)
+{
+    uint8_t n = num - stream->rx_next;
+
+    if (n == 0 || n >= 128) {
+        return;
+    }
+    RPC_TRACE_MSG(RPC_TRACE_ERR, RPC_EV_STREAM_LOST, &stream->slot->base, n);
+    stream->rx_next = num;
+    stream->rx_done += n;
+    stream->lost += n;
+}
+
+static void ubt_rpc_stream_credit_output(ubt_rpc_stream_t *stream, rpc_message_t *message)
+{
+    uint8_t ctrl = ATTR_RSP_ACK | (stream->acceptor ? ATTR_FLAG_ACCEPT : 0);
+    ubt_rpc_send_ack(stream->rpc, message, ctrl, message->base.cmd, stream->rx_done, NULL, false);
+}
+
+static int ubt_rpc_stream_output(ubt_rpc_stream_t *stream, uint8_t ctrl, uint8_t err, void *param)
+{
+    ubt_rpc_request_t *frame = ubt_rpc_create_request(stream->rpc, 0);
+    if (!frame) {
+        return -1;
+    }
+    frame->base = stream->slot->base;
+    frame->base.ctrl = ctrl | (stream->acceptor ? ATTR_FLAG_ACCEPT : 0);
+    frame->base.err = err;
+    frame->mask = stream->slot->mask;
+    frame->param = param;
+    if (ubt_rpc_output_cmd(stream->rpc, frame) != 0) {
+        ubt_rpc_request_destroy(stream->rpc, frame);
+        return -1;
+    }
+    return 0;
+}
+
+ubt_rpc_stream_t *ubt_rpc_stream_open(ubt_rpc_t *rpc, rpc_request_config_t *req_conf, void *param)
+{
+    ubt_rpc_stream_t *stream;
+    ubt_rpc_request_t *slot;
+    rpc_message_t *message = NULL;
+    uint32_t timeout;
+    uint16_t retry;
+
+    if (rpc == NULL || req_conf == NULL) {
+        return NULL;
+    }
+    stream = ubt_rpc_stream_alloc(rpc);
+    if (!stream) {
+        return NULL;
+    }
+    slot = stream->slot;
+    slot->base = req_conf->base;
+    slot->base.ctrl = ATTR_REQ;
+    slot->base.seq = gen_request_id(rpc);
+    slot->mask = req_conf->mask;
+    slot->param = param;
+    retry = req_conf->retry;
+#ifdef RPC_RTO_SUPPORT
+    slot->tx_tick = osKernelGetTickCount();
+    slot->resent = false;
+#endif
+
+    if (ubt_rpc_output_cmd(rpc, slot) != 0) {
+        ubt_rpc_stream_free(stream);
+        return NULL;
+    }
+    while (1) {
+        timeout = ubt_rpc_retry_timeout(rpc, &slot->base, req_conf->timeout, retry);
+        if (osMessageQueueGet(slot->queue, &message, NULL, timeout / portTICK_PERIOD_MS) == osOK) {
+            if (MSG_IS_PROBE(&message->base)) {
+                /* nothing taken yet, the acceptor probes again */
+                ubt_rpc_impl_lock(rpc);
+                stream->probe_queued = false;
+                ubt_rpc_impl_unlock(rpc);
+                ubt_rpc_message_free(message);
+                continue;
+            }
+            ubt_rpc_rto_sample(rpc, slot);
+            break;
+        }
+        if (!req_conf->timeout) {
+            ubt_rpc_rto_backoff(rpc, &slot->base);
+        }
+        if (retry == 0) {
+            RPC_TRACE_MSG(RPC_TRACE_ERR, RPC_EV_STREAM_OPEN, &slot->base, -1);
+            ubt_rpc_stream_free(stream);
+            return NULL;
+        }
+        retry--;
+        ubt_rpc_output_retransmit(rpc, slot);
+    }
+
+    if ((message->base.ctrl & 0x1F) == ATTR_RSP_REQ) {
+        /* the ACK got lost but the peer is already streaming */
+        stream->early = message;
+    } else {
+        stream->status = message->base.err;
+        ubt_rpc_message_free(message);
+        if (stream->status) {
+            RPC_TRACE_MSG(RPC_TRACE_ERR, RPC_EV_STREAM_OPEN, &slot->base, stream->status);
+            ubt_rpc_stream_free(stream);
+            return NULL;
+        }
+    }
+    ubt_rpc_impl_lock(rpc);
+    stream->established = true;
+    ubt_rpc_impl_unlock(rpc);
+    RPC_TRACE_MSG(RPC_TRACE_INFO, RPC_EV_STREAM_OPEN, &slot->base, 0);
+    return stream;
+}
+
+/* called from request_handler, which must then return NULL: the ACK is sent here */
+ubt_rpc_stream_t *ubt_rpc_stream_accept(rpc_message_t *message)
+{
+    ubt_rpc_t *rpc = message->rpc;
+    ubt_rpc_stream_t *stream = ubt_rpc_stream_alloc(rpc);
+    if (!stream) {
+        ubt_rpc_send_ack(rpc, message, ATTR_REQ_ACK, message->base.cmd + 1, RPC_ERR_STREAM_REFUSED, NULL, false);
+        return NULL;
+    }
+    stream->slot->base = message->base;
+#ifdef RPC_ADDRESS_SUPPORT
+    stream->slot->base.src = message->base.dst;
+    stream->slot->base.dst = message->base.src;
+#endif
+    stream->acceptor = true;
+    stream->established = true;
+    ubt_rpc_impl_lock(rpc);
+    list_add_tail(&stream->slot->list, &rpc->wait_response_head);
+    ubt_rpc_impl_unlock(rpc);
+    ubt_rpc_send_ack(rpc, message, ATTR_REQ_ACK, message->base.cmd + 1, 0, NULL, false);
+    return stream;
+}
+
+/* out of credit for a whole RTO: tell the receiver how many chunks were sent */
+static void ubt_rpc_stream_probe(ubt_rpc_stream_t *stream, uint32_t interval)
+{
+    uint32_t now = osKernelGetTickCount();
+    uint8_t sent;
+
+    ubt_rpc_impl_lock(stream->rpc);
+    if (stream->tx_sent == stream->tx_acked || (now - stream->tx_tick) * portTICK_PERIOD_MS < interval) {
+        ubt_rpc_impl_unlock(stream->rpc);
+        return;
+    }
+    stream->tx_tick = now;
+    sent = stream->tx_sent;
+    ubt_rpc_impl_unlock(stream->rpc);
+    RPC_TRACE_MSG(RPC_TRACE_INFO, RPC_EV_STREAM_PROBE, &stream->slot->base, sent);
+    ubt_rpc_stream_output(stream, ATTR_RSP_ACK | ATTR_FLAG_PROBE, sent, NULL);
+}
+
+/* param stays owned by the caller, as for a push */
+int ubt_rpc_stream_send(ubt_rpc_stream_t *stream, void *param, uint32_t timeout)
+{
+    uint32_t start = osKernelGetTickCount();
+    uint32_t interval, wait, spent;
+    uint8_t num;
+
+    /* a stream the peer has closed takes no more chunks */
+    if (stream == NULL || stream->closed || stream->fin_queued) {
+        return -1;
+    }
+    interval = ubt_rpc_retry_timeout(stream->rpc, &stream->slot->base, 0, 1);
+    /* wait in slices of one probe interval, a lost chunk or credit must not close the window for good */
+    while (1) {
+        wait = interval;
+        if (timeout != osWaitForever) {
+            spent = (osKernelGetTickCount() - start) * portTICK_PERIOD_MS;
+            wait = spent < timeout ? timeout - spent : 0;
+            wait = wait < interval ? wait : interval;
+        }
+        if (osSemaphoreAcquire(stream->credit, wait / portTICK_PERIOD_MS) == osOK) {
+            break;
+        }
+        ubt_rpc_stream_probe(stream, interval);
+        if (timeout != osWaitForever && (osKernelGetTickCount() - start) * portTICK_PERIOD_MS >= timeout) {
+            RPC_TRACE_MSG(RPC_TRACE_ERR, RPC_EV_NO_CREDIT, &stream->slot->base, timeout);
+            return -1;
+        }
+    }
+    ubt_rpc_impl_lock(stream->rpc);
+    num = stream->tx_sent++;
+    stream->tx_tick = osKernelGetTickCount();
+    ubt_rpc_impl_unlock(stream->rpc);
+    if (ubt_rpc_stream_output(stream, ATTR_RSP_REQ, num, param) != 0) {
+        ubt_rpc_impl_lock(stream->rpc);
+        stream->tx_sent--;
+        ubt_rpc_impl_unlock(stream->rpc);
+        osSemaphoreRelease(stream->credit);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * return 0 with a chunk, 1 when the peer closed the stream (status in stream->status), -1 on timeout.
+ * A chunk overtaken by a later one is written off, stream->lost counts them.
+ */
+int ubt_rpc_stream_recv(ubt_rpc_stream_t *stream, void **chunk, uint32_t timeout)
+{
+    rpc_message_t *message = NULL;
+    uint8_t num;
+
+    *chunk = NULL;
+    if (stream == NULL) {
+        return -1;
+    }
+    for (;;) {
+        if (stream->closed) {
+            return 1;
+        }
+        if (stream->early) {
+            message = stream->early;
+            stream->early = NULL;
+        } else if (osMessageQueueGet(stream->slot->queue, &message, NULL, timeout / portTICK_PERIOD_MS) != osOK) {
+            return -1;
+        }
+        if (MSG_IS_PROBE(&message->base)) {
+            /* every chunk sent before the probe has been dequeued by now */
+            ubt_rpc_impl_lock(stream->rpc);
+            stream->probe_queued = false;
+            ubt_rpc_impl_unlock(stream->rpc);
+            ubt_rpc_stream_skip(stream, message->base.err);
+            ubt_rpc_stream_credit_output(stream, message);
+            ubt_rpc_message_free(message);
+            continue;
+        }
+        if ((message->base.ctrl & 0x1F) != ATTR_RSP_REQ) {
+            /* duplicate ACK of the open */
+            ubt_rpc_message_free(message);
+            continue;
+        }
+        if (message->base.ctrl & ATTR_FLAG_FIN) {
+            stream->closed = true;
+            stream->status = message->base.err;
+            ubt_rpc_message_free(message);
+            continue;
+        }
+        num = message->base.err;
+        if ((uint8_t)(num - stream->rx_next) >= 128) {
+            /* duplicate, or already written off */
+            ubt_rpc_message_free(message);
+            continue;
+        }
+        ubt_rpc_stream_skip(stream, num);
+        stream->rx_next++;
+        stream->rx_done++;
+        ubt_rpc_stream_credit_output(stream, message);
+        *chunk = message->struct_data;
+        RPC_FREE(stream->rpc, msg_pool, message);
+        return 0;
+    }
+}
+
+/* unless the peer closed first, wait for its FIN so it does not keep the stream open */
+void ubt_rpc_stream_close(ubt_rpc_stream_t *stream, uint8_t status)
+{
+    rpc_message_t *message = NULL;
+    uint16_t retry = RPC_STREAM_FIN_RETRY;
+    uint32_t interval, start, spent;
+    bool fin;
+
+    if (stream == NULL) {
+        return;
+    }
+    ubt_rpc_impl_lock(stream->rpc);
+    stream->closing = true;
+    ubt_rpc_impl_unlock(stream->rpc);
+    if (!stream->closed) {
+        interval = ubt_rpc_retry_timeout(stream->rpc, &stream->slot->base, 0, 1);
+        ubt_rpc_stream_output(stream, ATTR_RSP_REQ | ATTR_FLAG_FIN, status, NULL);
+        start = osKernelGetTickCount();
+        while (1) {
+            spent = (osKernelGetTickCount() - start) * portTICK_PERIOD_MS;
+            if (spent < interval && osMessageQueueGet(stream->slot->queue, &message, NULL, (interval - spent) / portTICK_PERIOD_MS) == osOK) {
+                /* chunks, credits and probes still on their way are dropped */
+                fin = MSG_IS_FIN(&message->base);
+                ubt_rpc_message_free(message);
+                if (fin) {
+                    RPC_TRACE_MSG(RPC_TRACE_INFO, RPC_EV_STREAM_CLOSE, &stream->slot->base, 0);
+                    break;
+                }
+                continue;
+            }
+            if (retry == 0) {
+                RPC_TRACE_MSG(RPC_TRACE_ERR, RPC_EV_STREAM_CLOSE, &stream->slot->base, -1);
+                break;
+            }
+            retry--;
+            ubt_rpc_stream_output(stream, ATTR_RSP_REQ | ATTR_FLAG_FIN, status, NULL);
+            start = osKernelGetTickCount();
+        }
+    }
+    ubt_rpc_stream_free(stream);
+}
+#endif
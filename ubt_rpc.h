@@ -2,6 +2,10 @@
 #define __UBT_RPC_H__
 #include "ubt_rpc_config.h"
 #include "ubt_rpc_list.h"
+#include "ubt_rpc_transport.h"
+#ifdef RPC_LZ_SUPPORT
+#include "ubt_rpc_lz.h"
+#endif
 #include "cmsis_os2.h"
 
 #define UBT_RPC_DEFAULT_WAIT_TIMEOUT 5000
@@ -18,15 +22,28 @@ typedef struct {
     uint32_t cmd;       // index
 } ubt_rpc_msg_base_t;
 
+struct ubt_rpc_stream;
+
 typedef struct {
     struct list_head list;
     osMessageQueueId_t *queue;
+#ifdef RPC_STREAM_SUPPORT
+    struct ubt_rpc_stream *stream;
+#endif
 
     ubt_rpc_msg_base_t base;
 
     uint16_t retry;
     bool expect_ack;
     uint32_t timeout;
+    uint32_t mask;
+#ifdef RPC_RTO_SUPPORT
+    uint32_t tx_tick;   // first transmission
+    bool resent;        // Karn: no RTT sample from a retransmitted request
+#endif
+
+    uint8_t *data_buf;
+    uint32_t data_len;
 
     void *param;
 } ubt_rpc_request_t;
@@ -40,6 +57,9 @@ typedef struct {
     ubt_rpc_t *rpc;
 } rpc_message_t;
 
+typedef void *(*ubt_rpc_request_handler_t)(rpc_message_t *message);
+typedef void (*ubt_rpc_notify_handler_t)(rpc_message_t *message);
+
 #define ATTR_REQ        0
 #define ATTR_RSP        1
 #define ATTR_NOTIFY     2
@@ -48,9 +68,18 @@ typedef struct {
 #define ATTR_NOTI_ACK   5
 #define ATTR_RSP_REQ    6
 
+#define ATTR_FLAG_ACK   0x20    // notify sender expects ATTR_NOTI_ACK
+#define ATTR_FLAG_FIN   0x40    // last ATTR_RSP_REQ of a stream, err holds the close status
+#define ATTR_FLAG_LZ    0x80    // payload is ubt_rpc_lz compressed
+/* stream frames reuse two bits */
+#define ATTR_FLAG_ACCEPT    ATTR_FLAG_ACK   // ATTR_RSP_REQ/ATTR_RSP_ACK sent by the accepting side
+#define ATTR_FLAG_PROBE     ATTR_FLAG_FIN   // ATTR_RSP_ACK asking for the credit, err holds the chunks sent
+
 #define MSG_IS_REQ(msg) (((msg)->ctrl&0x1F) == ATTR_REQ)
 #define MSG_IS_ACK(msg) ((((msg)->ctrl&0x1F) == ATTR_REQ_ACK) || (((msg)->ctrl&0x1F) == ATTR_RSP_ACK) || (((msg)->ctrl&0x1F) == ATTR_NOTI_ACK))
 #define MSG_IS_NOTIFY(msg) (((msg)->ctrl&0x1F) == ATTR_NOTIFY)
+#define MSG_NEED_NOTI_ACK(msg) (MSG_IS_NOTIFY(msg) && ((msg)->ctrl & ATTR_FLAG_ACK))
+#define MSG_IS_STREAM(msg) ((((msg)->ctrl&0x1F) == ATTR_RSP_REQ) || (((msg)->ctrl&0x1F) == ATTR_RSP_ACK))
 
 #define MSG_IS_OUTDIR(msg) ((((msg)->ctrl&0x1F) == ATTR_REQ) || (((msg)->ctrl&0x1F) == ATTR_NOTIFY) || (((msg)->ctrl&0x1F) == ATTR_RSP_REQ))
 
@@ -60,8 +89,93 @@ typedef struct{
     uint16_t retry;
     bool expect_ack;
     uint32_t timeout;
+    uint32_t mask;
+
+    bool keep_param;    // ACK only: param is still owned by the caller, do not free
 }rpc_request_config_t;
 
+typedef struct {
+    rpc_request_config_t conf;
+    void *param;
+
+    void *response;
+    int status;                 // -1 until answered, then the err of the ACK
+    ubt_rpc_request_t *req;
+} ubt_rpc_call_t;
+
+typedef struct {
+    ubt_rpc_t *rpc;
+    osMessageQueueId_t *queue;  // completions of every call, in arrival order
+    ubt_rpc_call_t *calls;
+    uint16_t count;
+    uint16_t outstanding;
+} ubt_rpc_pipeline_t;
+
+#ifdef RPC_BATCH_SUPPORT
+#define RPC_CMD_BATCH   0xFFFFFFFEUL    // ACK cmd is RPC_CMD_BATCH + 1
+
+/* param of an RPC_CMD_BATCH frame, the codec serializes each item data by its cmd */
+typedef struct {
+    uint32_t cmd;
+    uint8_t err;
+    void *data;     // sub-request param, sub-response in the ACK
+} rpc_batch_item_t;
+
+typedef struct {
+    uint16_t count;
+    rpc_batch_item_t item[RPC_BATCH_MAX_ITEMS];
+} rpc_batch_t;
+#endif
+
+#ifdef RPC_DEDUP_SUPPORT
+/* seq: the sender's session in the top byte, picked at create, and a 24 bit counter */
+#define RPC_SEQ_SESSION(seq)    ((uint8_t)((seq) >> 24))
+#define RPC_SEQ_MASK            0x00FFFFFFUL
+
+typedef struct {
+    uint32_t seq;
+    uint32_t cmd;
+    uint8_t ctrl;
+    uint8_t err;
+    void *rsp;
+} rpc_dedup_rsp_t;
+
+typedef struct {
+    bool valid;
+#ifdef RPC_ADDRESS_SUPPORT
+    uint8_t addr;
+#endif
+    uint8_t session;    // a new session means the peer restarted
+    uint8_t behind;     // frames in a row from behind the window
+    uint32_t last_seq;
+    uint32_t window;    // bit n set: (last_seq - n) already received
+    uint8_t rsp_idx;
+    rpc_dedup_rsp_t rsp[RPC_DEDUP_RSP_CACHE];
+} rpc_dedup_peer_t;
+#endif
+
+#ifdef RPC_RTO_SUPPORT
+/* Jacobson/Karels estimator, RFC 6298 */
+typedef struct {
+    bool valid;
+    bool sampled;
+#ifdef RPC_ADDRESS_SUPPORT
+    uint8_t dst;
+#endif
+    uint8_t backoff;    // timeouts since the last sample, the RTO doubles with each
+    uint32_t cmd;       // rpc_rto_class() of the cmd
+    int32_t srtt;       // ms << 3
+    int32_t rttvar;     // ms << 2
+} rpc_rto_t;
+#endif
+
+#ifdef RPC_STATIC_MEMORY
+typedef struct {
+    struct slist_head free;
+    uint32_t block_size;
+} rpc_pool_t;
+#endif
+
 struct ubt_rpc {
     struct list_head call_list_head;
     struct list_head wait_response_head;
@@ -72,22 +186,135 @@ struct ubt_rpc {
     char *name;
     uint32_t call_id;
     osThreadId_t thread_id;
+#ifdef RPC_TX_STANDALONE_THREAD
+    osThreadId_t tx_thread;
+    osSemaphoreId_t tx_sem;
+#endif
     
     uint16_t active_request;
     uint16_t max_request;
+    uint32_t buffer_size;
+
+    ubt_rpc_request_handler_t request_handler;
+    ubt_rpc_notify_handler_t notify_handler;
+
+#ifdef RPC_DEDUP_SUPPORT
+    rpc_dedup_peer_t dedup[RPC_DEDUP_MAX_PEER];
+    uint8_t dedup_victim;
+    uint8_t session;
+#endif
+
+#ifdef RPC_RTO_SUPPORT
+    rpc_rto_t rto[RPC_RTO_ENTRIES];
+    uint8_t rto_victim;
+#endif
+
+#ifdef RPC_LZ_SUPPORT
+    osMutexId_t lz_mutex;   // guards the scratch below
+    uint16_t *lz_hash;      // match finder scratch
+    uint8_t *lz_buf;        // buffer_size bytes, holds one (de)compressed payload
+    uint32_t lz_cmd[RPC_LZ_MAX_CMD];
+    uint8_t lz_cmd_num;
+#endif
+
+#ifdef RPC_STATIC_MEMORY
+    rpc_pool_t req_pool;
+    rpc_pool_t buf_pool;
+    rpc_pool_t msg_pool;
+    rpc_pool_t param_pool;
+#ifdef RPC_STREAM_SUPPORT
+    rpc_pool_t stream_pool;
+#endif
+    osMessageQueueId_t *queue_pool;     // idle response queues, created once
+    uint16_t queue_idle;
+#endif
 };
 
 typedef struct {
     char *name;
     uint32_t task_stack_size;
     uint16_t max_request;
+    uint32_t buffer_size;
+    ubt_rpc_transport_t transport;
+
+    ubt_rpc_request_handler_t request_handler;
+    ubt_rpc_notify_handler_t notify_handler;
+
+#ifdef RPC_STATIC_MEMORY
+    void *arena;            // 8 byte aligned, at least ubt_rpc_arena_size() bytes
+    uint32_t arena_size;
+#endif
 } ubt_rpc_config_t;
 
+#ifdef RPC_STREAM_SUPPORT
+#define RPC_ERR_STREAM_REFUSED 1
+
+/*
+ * A stream keeps one slot of the pending table (its seq and queue) from open to close.
+ * Chunks are ATTR_RSP_REQ frames carrying that seq and their number in err. Once the
+ * receiver has taken a chunk it answers an ATTR_RSP_ACK with the count of chunks taken
+ * or lost so far, so a lost credit is made up by the next one. A sender that runs out
+ * of credit probes with the count it has sent, the receiver then writes off what never
+ * arrived. At most RPC_STREAM_WINDOW chunks are in flight.
+ * A FIN is answered with a FIN by a side that has not closed yet, the closing side
+ * retransmits it until then. A retransmitted open of an accepted stream is ACKed again.
+ */
+typedef struct ubt_rpc_stream {
+    ubt_rpc_t *rpc;
+    ubt_rpc_request_t *slot;
+    osSemaphoreId_t credit;
+    rpc_message_t *early;   // chunk that overtook the ACK of the open
+    bool acceptor;          // frames of this side carry ATTR_FLAG_ACCEPT
+    bool established;
+    bool closed;
+    bool probe_queued;      // a probe is waiting in the slot queue, later ones are dropped
+    bool fin_queued;        // the peer's FIN is in the slot queue, retransmits are only answered
+    bool closing;           // this side sent its FIN, the peer's FIN is not answered any more
+    uint8_t status;
+    uint8_t tx_sent;        // chunks sent, mod 256
+    uint8_t tx_acked;       // last cumulative credit
+    uint8_t rx_next;        // number of the next chunk expected
+    uint8_t rx_done;        // chunks taken or written off, returned as credit
+    uint32_t tx_tick;       // last chunk sent, credit received or probe
+    uint32_t lost;          // chunks written off by this receiver
+} ubt_rpc_stream_t;
+#endif
+
 ubt_rpc_t *ubt_rpc_create(ubt_rpc_config_t *config);
 void ubt_rpc_destroy(ubt_rpc_t *rpc);
+#ifdef RPC_STATIC_MEMORY
+uint32_t ubt_rpc_arena_size(const ubt_rpc_config_t *config);
+#endif
+rpc_message_t *ubt_rpc_message_alloc(ubt_rpc_t *rpc);
+void *ubt_rpc_param_alloc(ubt_rpc_t *rpc, uint32_t size);
+void ubt_rpc_param_release(ubt_rpc_t *rpc, void *param);
 void *ubt_rpc_perform_request(ubt_rpc_t *rpc, uint32_t dst_dev, uint32_t id, uint32_t cmd, void *param);
 void ubt_rpc_perform_push(ubt_rpc_t *rpc, uint32_t dst_dev, uint32_t id, uint32_t cmd, void *param, uint32_t mask);
+int ubt_rpc_perform_push_reliable(ubt_rpc_t *rpc, uint32_t dst_dev, uint32_t id, uint32_t cmd, void *param, uint32_t mask, uint16_t retry);
 void *ubt_rpc_perform(ubt_rpc_t *rpc, rpc_request_config_t *req_conf, void *param);
-void ubt_rpc_output_cmd(ubt_rpc_t *rpc, ubt_rpc_request_t req);
+int ubt_rpc_output_cmd(ubt_rpc_t *rpc, ubt_rpc_request_t *req);
+/* supplied by the codec: frame req->base and req->param into req->data_buf (req->data_len bytes free), set data_len, 0 or -1 */
+int ubt_rpc_codec_encode(ubt_rpc_t *rpc, ubt_rpc_request_t *req);
+
+int ubt_rpc_pipeline_submit(ubt_rpc_t *rpc, ubt_rpc_pipeline_t *pl, ubt_rpc_call_t *calls, uint16_t count);
+int ubt_rpc_pipeline_wait(ubt_rpc_pipeline_t *pl, uint32_t timeout);
+void ubt_rpc_pipeline_release(ubt_rpc_pipeline_t *pl);
+int ubt_rpc_perform_pipeline(ubt_rpc_t *rpc, ubt_rpc_call_t *calls, uint16_t count);
+#ifdef RPC_LZ_SUPPORT
+int ubt_rpc_set_compress(ubt_rpc_t *rpc, uint32_t cmd, bool enable);
+void ubt_rpc_payload_compress(ubt_rpc_t *rpc, ubt_rpc_msg_base_t *base, uint8_t *payload, uint32_t *len);
+int ubt_rpc_payload_decompress(ubt_rpc_t *rpc, ubt_rpc_msg_base_t *base, uint8_t *payload, uint32_t *len, uint32_t cap);
+#endif
+#ifdef RPC_BATCH_SUPPORT
+int ubt_rpc_perform_batch(ubt_rpc_t *rpc, rpc_request_config_t *req_conf, ubt_rpc_call_t *calls, uint16_t count);
+#endif
+
+#ifdef RPC_STREAM_SUPPORT
+ubt_rpc_stream_t *ubt_rpc_stream_open(ubt_rpc_t *rpc, rpc_request_config_t *req_conf, void *param);
+ubt_rpc_stream_t *ubt_rpc_stream_accept(rpc_message_t *message);
+int ubt_rpc_stream_send(ubt_rpc_stream_t *stream, void *param, uint32_t timeout);
+int ubt_rpc_stream_recv(ubt_rpc_stream_t *stream, void **chunk, uint32_t timeout);
+void ubt_rpc_stream_close(ubt_rpc_stream_t *stream, uint8_t status);
+#endif
 
 #endif
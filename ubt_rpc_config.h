@@ -16,4 +16,75 @@
 #define RPC_TX_STANDALONE_THREAD
 
 #define RPC_ADDRESS_SUPPORT
-#endif
\ No newline at end of file
+
+#define RPC_DEDUP_SUPPORT
+#ifdef RPC_DEDUP_SUPPORT
+#define RPC_DEDUP_WINDOW            32      // seq bitmap depth per peer, <= 32
+#define RPC_DEDUP_MAX_PEER          4
+#define RPC_DEDUP_RSP_CACHE         4       // cached ACKs replayed to retransmits, per peer
+#define RPC_DEDUP_RESYNC            4       // frames in a row from behind the window that make the peer start over
+/* port: must differ across resets, a hardware RNG or a boot counter kept in flash; the tick count does not */
+// #define rpc_session_seed()          hw_rng_read()
+#endif
+
+#define RPC_STREAM_SUPPORT
+#ifdef RPC_STREAM_SUPPORT
+#define RPC_STREAM_WINDOW           4       // chunks in flight per stream, < 128
+#define RPC_STREAM_FIN_RETRY        3       // FIN retransmits before a close gives up on the peer
+#endif
+
+#define RPC_BATCH_SUPPORT
+#ifdef RPC_BATCH_SUPPORT
+#define RPC_BATCH_MAX_ITEMS         16      // sub-requests per batch frame
+#endif
+
+/* payload compression, only enable it when every peer can decode ATTR_FLAG_LZ */
+// #define RPC_LZ_SUPPORT
+#ifdef RPC_LZ_SUPPORT
+#define RPC_LZ_THRESHOLD            0       // compress every payload from this size, 0: per cmd opt-in only
+#define RPC_LZ_MAX_CMD              8       // cmds opted in by ubt_rpc_set_compress()
+#define RPC_LZ_HASH_BITS            9       // match finder scratch: 2^n * 2 bytes
+#define RPC_LZ_WINDOW               4096
+#endif
+
+/* retransmit timeout learnt from measured RTT when a request is sent with timeout 0 */
+#define RPC_RTO_SUPPORT
+#ifdef RPC_RTO_SUPPORT
+#define RPC_RTO_ENTRIES             16      // (dst, cmd class) estimators
+#define RPC_RTO_INIT                1000    // ms, before the first sample
+#define RPC_RTO_MIN                 20      // ms
+#define RPC_RTO_MAX                 5000    // ms, also caps the backoff
+#define rpc_rto_class(cmd)          (cmd)   // map cmds with alike latency onto one estimator
+#endif
+
+#define RPC_TRACE_LEVEL             1       // 0: off, 1: errors, 2: + request flow, 3: + alloc/free
+#define RPC_TRACE_RING_SIZE         64      // records per thread ring, power of 2
+#define RPC_TRACE_RINGS             4       // threads that can trace
+#define rpc_trace_get_tick()        osKernelGetTickCount()
+
+/*
+ * Every object is carved from config->arena in ubt_rpc_create(), no heap afterwards.
+ * Responses from request_handler and decoded params must then come from ubt_rpc_param_alloc().
+ */
+// #define RPC_STATIC_MEMORY
+#ifdef RPC_STATIC_MEMORY
+#include "rtx_os.h"
+#define RPC_STATIC_TX_FRAMES        8       // fire-and-forget frames in flight: ACKs, pushes, chunks, pipelined calls
+#define RPC_STATIC_RX_MESSAGES      8       // received messages queued or being handled
+#define RPC_STATIC_PARAMS           16      // decoded params and handler responses, the dedup cache comes on top
+#define RPC_STATIC_QUEUE_DEPTH      8       // every response queue, bounds the stream window and the pipeline size
+#define RPC_OS_THREAD_CB_SIZE       osRtxThreadCbSize
+#define RPC_OS_MUTEX_CB_SIZE        osRtxMutexCbSize
+#define RPC_OS_SEMAPHORE_CB_SIZE    osRtxSemaphoreCbSize
+#define RPC_OS_MQ_CB_SIZE           osRtxMessageQueueCbSize
+#define RPC_OS_MQ_MEM_SIZE(n, size) osRtxMessageQueueMemSize(n, size)
+#endif
+
+/* shared memory transport, ubt_rpc_shm.c, linux hosts only */
+#define RPC_SHM_SPIN                200     // polls of an empty ring before sleeping on the doorbell
+#define RPC_SHM_WRITE_TIMEOUT       100     // ms a writer waits for the peer to free ring space
+
+/* link simulator, ubt_rpc_sim.c */
+#define RPC_SIM_QUEUE_MAX           64      // frames held for delayed delivery
+#define RPC_SIM_STACK_SIZE          1024
+#endif
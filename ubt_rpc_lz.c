@@ -0,0 +1,185 @@
+#include <string.h>
+#include "ubt_rpc_lz.h"
+
+#define LZ_MIN_MATCH        4
+#define LZ_LAST_LITERALS    5       // the block always ends with at least this many literals
+#define LZ_MF_LIMIT         12      // no match may start closer than this to the end
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+    return (uint32_t)(v * 2654435761U) >> (32 - RPC_LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_len(uint8_t *op, uint8_t *oend, uint32_t len)
+{
+    while (len >= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *lz_put_literals(uint8_t *op, uint8_t *oend, const uint8_t *lit, uint32_t lit_len, uint32_t match_len)
+{
+    uint8_t *token;
+
+    if (op >= oend) {
+        return NULL;
+    }
+    token = op++;
+    *token = (uint8_t)(((lit_len >= 15) ? 15 : lit_len) << 4);
+    *token |= (uint8_t)((match_len >= 15) ? 15 : match_len);
+    if (lit_len >= 15) {
+        op = lz_put_len(op, oend, lit_len - 15);
+        if (op == NULL) {
+            return NULL;
+        }
+    }
+    if ((uint32_t)(oend - op) < lit_len) {
+        return NULL;
+    }
+    memcpy(op, lit, lit_len);
+    return op + lit_len;
+}
+
+uint32_t ubt_rpc_lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap, uint16_t *hash)
+{
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend = src + len;
+    const uint8_t *mflimit;
+    const uint8_t *mlimit;
+    const uint8_t *ref;
+    const uint8_t *mp;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    uint32_t seq, h, off, mlen;
+
+    if (len > 0xFFFF) {
+        return 0;
+    }
+    memset(hash, 0, RPC_LZ_HASH_SIZE);
+
+    if (len > LZ_MF_LIMIT) {
+        mflimit = iend - LZ_MF_LIMIT;
+        mlimit = iend - LZ_LAST_LITERALS;
+        ip++;
+        while (ip < mflimit) {
+            seq = lz_read32(ip);
+            h = lz_hash(seq);
+            ref = src + hash[h];
+            hash[h] = (uint16_t)(ip - src);
+            if (ref >= ip || (uint32_t)(ip - ref) > RPC_LZ_WINDOW || lz_read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            mp = ip + LZ_MIN_MATCH;
+            while (mp < mlimit && *mp == ref[mp - ip]) {
+                mp++;
+            }
+            mlen = (uint32_t)(mp - ip) - LZ_MIN_MATCH;
+            off = (uint32_t)(ip - ref);
+
+            op = lz_put_literals(op, oend, anchor, (uint32_t)(ip - anchor), mlen);
+            if (op == NULL || oend - op < 2) {
+                return 0;
+            }
+            *op++ = (uint8_t)(off & 0xFF);
+            *op++ = (uint8_t)(off >> 8);
+            if (mlen >= 15) {
+                op = lz_put_len(op, oend, mlen - 15);
+                if (op == NULL) {
+                    return 0;
+                }
+            }
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    op = lz_put_literals(op, oend, anchor, (uint32_t)(iend - anchor), 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return (uint32_t)(op - dst);
+}
+
+uint32_t ubt_rpc_lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + len;
+    const uint8_t *ref;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    uint32_t token, lit, mlen, off, b;
+
+    while (ip < iend) {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend) {
+                    return 0;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (uint32_t)(iend - ip) || lit > (uint32_t)(oend - op)) {
+            return 0;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip >= iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return 0;
+        }
+        off = ip[0] | ((uint32_t)ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (uint32_t)(op - dst)) {
+            return 0;
+        }
+        mlen = token & 0x0F;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) {
+                    return 0;
+                }
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (uint32_t)(oend - op)) {
+            return 0;
+        }
+        /* byte copy, the match may overlap the output */
+        ref = op - off;
+        while (mlen--) {
+            *op++ = *ref++;
+        }
+    }
+    return (uint32_t)(op - dst);
+}
@@ -0,0 +1,23 @@
+#ifndef __UBT_RPC_LZ_H__
+#define __UBT_RPC_LZ_H__
+#include <stdint.h>
+#include "ubt_rpc_config.h"
+
+/*
+ * LZ4 block format compressor with a fixed window, for payloads up to 64KB.
+ * hash is caller supplied scratch of (1 << RPC_LZ_HASH_BITS) entries, no other memory is used.
+ * Both return the output length, 0 if the output does not fit or the input is corrupt.
+ */
+#ifndef RPC_LZ_HASH_BITS
+#define RPC_LZ_HASH_BITS            9
+#endif
+#ifndef RPC_LZ_WINDOW
+#define RPC_LZ_WINDOW               4096
+#endif
+
+#define RPC_LZ_HASH_SIZE            ((1UL << RPC_LZ_HASH_BITS) * sizeof(uint16_t))
+
+uint32_t ubt_rpc_lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap, uint16_t *hash);
+uint32_t ubt_rpc_lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap);
+
+#endif
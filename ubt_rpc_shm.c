@@ -0,0 +1,409 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "ubt_rpc_shm.h"
+
+#define SHM_MAGIC           0x55525348UL    // "URSH"
+#define SHM_LINE            64              // keep producer and consumer indexes on their own cache line
+#define SHM_WRAP            0xFFFFFFFFUL    // record header: rest of the ring is unused, frame starts at 0
+#define SHM_ALIGN(n)        (((n) + 3) & ~3UL)
+#define SHM_RECORD(n)       (4 + SHM_ALIGN(n))
+
+typedef struct {
+    uint32_t head;              // bytes published, free running, written by the producer only
+    uint8_t pad0[SHM_LINE - 4];
+    uint32_t tail;              // bytes consumed, free running, written by the consumer only
+    uint32_t sleeping;          // consumer is (about to be) blocked on the doorbell
+    uint8_t pad1[SHM_LINE - 8];
+} rpc_shm_ring_t;
+
+/* start of the region, ring 0 data and ring 1 data follow at SHM_HDR_SIZE */
+typedef struct {
+    uint32_t magic;
+    uint32_t ring_size;
+    uint8_t pad[SHM_LINE - 8];
+    rpc_shm_ring_t ring[2];     // ring 0: side 0 -> side 1, ring 1: side 1 -> side 0
+} rpc_shm_region_t;
+
+#define SHM_HDR_SIZE        ((sizeof(rpc_shm_region_t) + SHM_LINE - 1) & ~(SHM_LINE - 1UL))
+
+struct ubt_rpc_shm {
+    rpc_shm_region_t *region;
+    uint32_t map_size;
+    uint32_t size;
+    int mem_fd;
+    int bell_fd[2];             // bell_fd[i] is rung when ring i gets data
+
+    rpc_shm_ring_t *tx;
+    uint8_t *tx_data;
+    int tx_bell;
+    uint32_t tx_head;           // local copy of tx->head
+    uint32_t tx_skip;           // reserved frame goes after a wrap marker
+
+    rpc_shm_ring_t *rx;
+    uint8_t *rx_data;
+    int rx_bell;
+    uint32_t rx_tail;           // local copy of rx->tail, runs ahead over wrap markers
+    uint32_t rx_record;         // size of the peeked record, 0 if none
+    bool rx_broken;             // the peer published a record outside the ring
+};
+
+static uint64_t shm_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static ubt_rpc_shm_t *ubt_rpc_shm_map(int mem_fd, const int bell_fd[2], uint32_t map_size)
+{
+    ubt_rpc_shm_t *shm;
+    uint8_t *base;
+
+    base = (uint8_t *)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    shm = (ubt_rpc_shm_t *)rpc_malloc(sizeof(ubt_rpc_shm_t));
+    if (!shm) {
+        munmap(base, map_size);
+        return NULL;
+    }
+    memset(shm, 0, sizeof(ubt_rpc_shm_t));
+    shm->region = (rpc_shm_region_t *)base;
+    shm->map_size = map_size;
+    shm->mem_fd = mem_fd;
+    shm->bell_fd[0] = bell_fd[0];
+    shm->bell_fd[1] = bell_fd[1];
+    return shm;
+}
+
+static void ubt_rpc_shm_bind(ubt_rpc_shm_t *shm, uint8_t side)
+{
+    uint8_t *data = (uint8_t *)shm->region + SHM_HDR_SIZE;
+
+    shm->size = shm->region->ring_size;
+    shm->tx = &shm->region->ring[side];
+    shm->tx_data = data + side * shm->size;
+    shm->tx_bell = shm->bell_fd[side];
+    shm->tx_head = __atomic_load_n(&shm->tx->head, __ATOMIC_RELAXED);
+    shm->rx = &shm->region->ring[side ^ 1];
+    shm->rx_data = data + (side ^ 1) * shm->size;
+    shm->rx_bell = shm->bell_fd[side ^ 1];
+    shm->rx_tail = __atomic_load_n(&shm->rx->tail, __ATOMIC_RELAXED);
+}
+
+ubt_rpc_shm_t *ubt_rpc_shm_create(uint32_t ring_size)
+{
+    ubt_rpc_shm_t *shm;
+    uint32_t map_size;
+    int mem_fd;
+    int bell_fd[2];
+
+    if (ring_size < 256 || (ring_size & (ring_size - 1))) {
+        return NULL;
+    }
+    map_size = SHM_HDR_SIZE + 2 * ring_size;
+    mem_fd = memfd_create("ubt_rpc_shm", 0);
+    if (mem_fd < 0) {
+        return NULL;
+    }
+    bell_fd[0] = eventfd(0, EFD_NONBLOCK);
+    bell_fd[1] = eventfd(0, EFD_NONBLOCK);
+    if (bell_fd[0] < 0 || bell_fd[1] < 0 || ftruncate(mem_fd, map_size) < 0) {
+        goto fail;
+    }
+    shm = ubt_rpc_shm_map(mem_fd, bell_fd, map_size);
+    if (!shm) {
+        goto fail;
+    }
+    /* a fresh memfd reads as zeros, only the header needs filling in */
+    shm->region->ring_size = ring_size;
+    __atomic_store_n(&shm->region->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    ubt_rpc_shm_bind(shm, 0);
+    return shm;
+
+fail:
+    if (bell_fd[0] >= 0) {
+        close(bell_fd[0]);
+    }
+    if (bell_fd[1] >= 0) {
+        close(bell_fd[1]);
+    }
+    close(mem_fd);
+    return NULL;
+}
+
+/* takes over the fds, they are closed by ubt_rpc_shm_destroy() */
+ubt_rpc_shm_t *ubt_rpc_shm_attach(int mem_fd, const int bell_fd[2])
+{
+    ubt_rpc_shm_t *shm;
+    struct stat st;
+
+    if (fstat(mem_fd, &st) < 0 || st.st_size < (off_t)SHM_HDR_SIZE) {
+        return NULL;
+    }
+    shm = ubt_rpc_shm_map(mem_fd, bell_fd, (uint32_t)st.st_size);
+    if (!shm) {
+        return NULL;
+    }
+    if (__atomic_load_n(&shm->region->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        shm->region->ring_size < 256 || (shm->region->ring_size & (shm->region->ring_size - 1)) ||
+        SHM_HDR_SIZE + 2 * (uint64_t)shm->region->ring_size != shm->map_size) {
+        munmap(shm->region, shm->map_size);
+        rpc_free(shm);
+        return NULL;
+    }
+    ubt_rpc_shm_bind(shm, 1);
+    return shm;
+}
+
+void ubt_rpc_shm_fds(ubt_rpc_shm_t *shm, int *mem_fd, int bell_fd[2])
+{
+    *mem_fd = shm->mem_fd;
+    bell_fd[0] = shm->bell_fd[0];
+    bell_fd[1] = shm->bell_fd[1];
+}
+
+void ubt_rpc_shm_destroy(ubt_rpc_shm_t *shm)
+{
+    if (!shm) {
+        return;
+    }
+    munmap(shm->region, shm->map_size);
+    close(shm->bell_fd[0]);
+    close(shm->bell_fd[1]);
+    close(shm->mem_fd);
+    rpc_free(shm);
+}
+
+/*
+ * Room for a len byte frame in the tx ring, the caller builds the frame in place
+ * and publishes it with ubt_rpc_shm_commit(). NULL while the ring is full.
+ */
+uint8_t *ubt_rpc_shm_reserve(ubt_rpc_shm_t *shm, uint32_t len)
+{
+    uint32_t off = shm->tx_head & (shm->size - 1);
+    uint32_t record = SHM_RECORD(len);
+    uint32_t used;
+
+    /* at most half the ring, so a frame plus its wrap skip always fits an empty ring */
+    if (record > shm->size / 2) {
+        return NULL;
+    }
+    shm->tx_skip = (off + record > shm->size) ? shm->size - off : 0;
+    used = shm->tx_head - __atomic_load_n(&shm->tx->tail, __ATOMIC_ACQUIRE);
+    if (used > shm->size || shm->size - used < shm->tx_skip + record) {
+        return NULL;
+    }
+    return shm->tx_data + (shm->tx_skip ? 0 : off) + 4;
+}
+
+/* len may be shorter than what was reserved */
+void ubt_rpc_shm_commit(ubt_rpc_shm_t *shm, uint32_t len)
+{
+    uint32_t off = shm->tx_head & (shm->size - 1);
+
+    if (shm->tx_skip) {
+        *(uint32_t *)(shm->tx_data + off) = SHM_WRAP;
+        off = 0;
+    }
+    *(uint32_t *)(shm->tx_data + off) = len;
+    shm->tx_head += shm->tx_skip + SHM_RECORD(len);
+    shm->tx_skip = 0;
+    __atomic_store_n(&shm->tx->head, shm->tx_head, __ATOMIC_RELEASE);
+
+    /* pairs with the fence in ubt_rpc_shm_wait_data(): either it sees the head or we see it sleeping */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->tx->sleeping, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        (void)!write(shm->tx_bell, &one, sizeof(one));
+    }
+}
+
+int ubt_rpc_shm_write(ubt_rpc_shm_t *shm, const uint8_t *buf, uint32_t len)
+{
+    uint64_t deadline = 0;
+    uint8_t *frame;
+
+    while (!(frame = ubt_rpc_shm_reserve(shm, len))) {
+        if (SHM_RECORD(len) > shm->size / 2) {
+            return -1;
+        }
+        if (!deadline) {
+            deadline = shm_now_ms() + RPC_SHM_WRITE_TIMEOUT;
+        } else if (shm_now_ms() >= deadline) {
+            return -1;
+        }
+        sched_yield();
+    }
+    memcpy(frame, buf, len);
+    ubt_rpc_shm_commit(shm, len);
+    return 0;
+}
+
+/*
+ * Next received frame, in place in the rx ring. It stays valid and is returned again
+ * until ubt_rpc_shm_release(). -1 if the ring is empty, -2 once the peer has published
+ * a record that does not fit the ring: the position in it is lost, nothing more is read.
+ */
+int ubt_rpc_shm_peek(ubt_rpc_shm_t *shm, const uint8_t **frame, uint32_t *len)
+{
+    uint32_t head = __atomic_load_n(&shm->rx->head, __ATOMIC_ACQUIRE);
+    uint32_t off, word, avail;
+
+    if (shm->rx_broken) {
+        return -2;
+    }
+    while (shm->rx_tail != head) {
+        avail = head - shm->rx_tail;
+        off = shm->rx_tail & (shm->size - 1);
+        if (avail > shm->size) {
+            goto broken;
+        }
+        word = *(const uint32_t *)(shm->rx_data + off);
+        if (word == SHM_WRAP) {
+            if (off == 0 || shm->size - off > avail) {
+                goto broken;
+            }
+            shm->rx_tail += shm->size - off;
+            continue;
+        }
+        /* a frame is never more than half the ring and never runs past its end */
+        if (word > shm->size / 2 - 4 || off + SHM_RECORD(word) > shm->size || SHM_RECORD(word) > avail) {
+            goto broken;
+        }
+        *frame = shm->rx_data + off + 4;
+        *len = word;
+        shm->rx_record = SHM_RECORD(word);
+        return 0;
+    }
+    return -1;
+
+broken:
+    shm->rx_broken = true;
+    return -2;
+}
+
+void ubt_rpc_shm_release(ubt_rpc_shm_t *shm)
+{
+    if (!shm->rx_record) {
+        return;
+    }
+    shm->rx_tail += shm->rx_record;
+    shm->rx_record = 0;
+    __atomic_store_n(&shm->rx->tail, shm->rx_tail, __ATOMIC_RELEASE);
+}
+
+/* copying receive, returns the frame length, 0 if none, -1 if buf is too small or the ring is broken */
+int ubt_rpc_shm_read(ubt_rpc_shm_t *shm, uint8_t *buf, uint32_t len)
+{
+    const uint8_t *frame;
+    uint32_t frame_len;
+    int rc;
+
+    rc = ubt_rpc_shm_peek(shm, &frame, &frame_len);
+    if (rc < 0) {
+        return rc == -1 ? 0 : -1;
+    }
+    if (frame_len > len) {
+        return -1;
+    }
+    memcpy(buf, frame, frame_len);
+    ubt_rpc_shm_release(shm);
+    return (int)frame_len;
+}
+
+static bool ubt_rpc_shm_readable(ubt_rpc_shm_t *shm)
+{
+    return shm->rx_record || __atomic_load_n(&shm->rx->head, __ATOMIC_ACQUIRE) != shm->rx_tail;
+}
+
+/* spins a little first, the doorbell syscall is only paid when the ring stays empty */
+osStatus_t ubt_rpc_shm_wait_data(ubt_rpc_shm_t *shm, uint32_t timeout)
+{
+    uint64_t deadline = 0;
+    struct pollfd pfd = { .fd = shm->rx_bell, .events = POLLIN };
+    uint64_t count;
+    int wait_ms;
+    uint32_t i;
+
+    if (shm->rx_broken) {
+        return osError;
+    }
+    for (i = 0; i < RPC_SHM_SPIN; i++) {
+        if (ubt_rpc_shm_readable(shm)) {
+            return osOK;
+        }
+    }
+    if (timeout != osWaitForever) {
+        deadline = shm_now_ms() + timeout;
+    }
+    while (1) {
+        __atomic_store_n(&shm->rx->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ubt_rpc_shm_readable(shm)) {
+            break;
+        }
+        wait_ms = -1;
+        if (timeout != osWaitForever) {
+            uint64_t now = shm_now_ms();
+            if (now >= deadline) {
+                __atomic_store_n(&shm->rx->sleeping, 0, __ATOMIC_RELAXED);
+                return osErrorTimeout;
+            }
+            wait_ms = (int)(deadline - now);
+        }
+        if (poll(&pfd, 1, wait_ms) > 0) {
+            (void)!read(shm->rx_bell, &count, sizeof(count));
+        }
+    }
+    __atomic_store_n(&shm->rx->sleeping, 0, __ATOMIC_RELAXED);
+    return osOK;
+}
+
+static int shm_tp_write(void *ctx, const uint8_t *buf, uint32_t len, uint32_t mask)
+{
+    (void)mask;
+    return ubt_rpc_shm_write((ubt_rpc_shm_t *)ctx, buf, len);
+}
+
+static int shm_tp_read(void *ctx, uint8_t *buf, uint32_t len)
+{
+    return ubt_rpc_shm_read((ubt_rpc_shm_t *)ctx, buf, len);
+}
+
+static osStatus_t shm_tp_wait_data(void *ctx, uint32_t timeout)
+{
+    return ubt_rpc_shm_wait_data((ubt_rpc_shm_t *)ctx, timeout);
+}
+
+static int shm_tp_peek_frame(void *ctx, const uint8_t **frame, uint32_t *len)
+{
+    return ubt_rpc_shm_peek((ubt_rpc_shm_t *)ctx, frame, len);
+}
+
+static void shm_tp_release_frame(void *ctx)
+{
+    ubt_rpc_shm_release((ubt_rpc_shm_t *)ctx);
+}
+
+void ubt_rpc_shm_transport(ubt_rpc_shm_t *shm, ubt_rpc_transport_t *transport)
+{
+    transport->ctx = shm;
+    transport->write = shm_tp_write;
+    transport->read = shm_tp_read;
+    transport->wait_data = shm_tp_wait_data;
+    transport->peek_frame = shm_tp_peek_frame;
+    transport->release_frame = shm_tp_release_frame;
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef __UBT_RPC_SHM_H__
+#define __UBT_RPC_SHM_H__
+#include <stdint.h>
+#include "ubt_rpc_config.h"
+#include "ubt_rpc_transport.h"
+
+/*
+ * Shared memory transport for two endpoints on one machine.
+ * One region holds a single producer / single consumer ring per direction;
+ * the reader peeks frames in place. Through the transport, write() copies the
+ * encoded frame into the ring; a caller that builds its frames itself can skip
+ * that copy with ubt_rpc_shm_reserve()/ubt_rpc_shm_commit().
+ * A doorbell (eventfd) is only rung when the reader went to sleep on an empty ring.
+ * A frame can take up to ring_size / 2 - 4 bytes. The peer is not trusted: a record
+ * that does not fit the ring stops the receive side for good, see ubt_rpc_shm_peek().
+ *
+ * The creator gets side 0, the peer attaches with the fds from ubt_rpc_shm_fds()
+ * (inherited over fork or passed with SCM_RIGHTS) and gets side 1.
+ */
+typedef struct ubt_rpc_shm ubt_rpc_shm_t;
+
+ubt_rpc_shm_t *ubt_rpc_shm_create(uint32_t ring_size);
+ubt_rpc_shm_t *ubt_rpc_shm_attach(int mem_fd, const int bell_fd[2]);
+void ubt_rpc_shm_fds(ubt_rpc_shm_t *shm, int *mem_fd, int bell_fd[2]);
+void ubt_rpc_shm_destroy(ubt_rpc_shm_t *shm);
+
+uint8_t *ubt_rpc_shm_reserve(ubt_rpc_shm_t *shm, uint32_t len);
+void ubt_rpc_shm_commit(ubt_rpc_shm_t *shm, uint32_t len);
+int ubt_rpc_shm_write(ubt_rpc_shm_t *shm, const uint8_t *buf, uint32_t len);
+
+int ubt_rpc_shm_peek(ubt_rpc_shm_t *shm, const uint8_t **frame, uint32_t *len);
+void ubt_rpc_shm_release(ubt_rpc_shm_t *shm);
+int ubt_rpc_shm_read(ubt_rpc_shm_t *shm, uint8_t *buf, uint32_t len);
+osStatus_t ubt_rpc_shm_wait_data(ubt_rpc_shm_t *shm, uint32_t timeout);
+
+void ubt_rpc_shm_transport(ubt_rpc_shm_t *shm, ubt_rpc_transport_t *transport);
+
+#endif
@@ -0,0 +1,306 @@
+#include <string.h>
+#include "ubt_rpc_sim.h"
+#include "ubt_rpc_list.h"
+
+#define SIM_BEFORE(a, b)    ((int32_t)((a) - (b)) < 0)
+/* delays are configured in ms, rounded up so a short one is not lost on a coarse tick */
+#define SIM_MS_TO_TICKS(ms) (((ms) + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS)
+
+typedef struct {
+    struct list_head list;
+    uint32_t due;               // tick at which it is written to the lower transport
+    uint32_t mask;
+    uint32_t len;
+    uint8_t data[];
+} rpc_sim_frame_t;
+
+struct ubt_rpc_sim {
+    ubt_rpc_transport_t lower;
+    ubt_rpc_sim_config_t conf;
+    uint32_t rand;
+    uint32_t link_free;         // tick the bandwidth limited link is idle again
+    uint64_t link_rem;          // part of a tick already used on the link, in bytes * 1000
+    uint32_t last_due;          // keeps frames in order unless picked for reordering
+    struct list_head pending;   // sorted by due
+    uint16_t pending_num;
+    ubt_rpc_sim_stats_t stats;
+    osMutexId_t lock;
+    osSemaphoreId_t wake;
+    osThreadId_t thread;
+};
+
+static uint32_t sim_rand(ubt_rpc_sim_t *sim)
+{
+    uint32_t x = sim->rand;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim->rand = x;
+    return x;
+}
+
+static bool sim_chance(ubt_rpc_sim_t *sim, uint16_t permille)
+{
+    return permille && sim_rand(sim) % 1000 < permille;
+}
+
+static void sim_deliver(ubt_rpc_sim_t *sim, const uint8_t *buf, uint32_t len, uint32_t mask)
+{
+    if (sim->lower.write(sim->lower.ctx, buf, len, mask) == 0) {
+        sim->stats.delivered_frames++;
+        sim->stats.delivered_bytes += len;
+    }
+}
+
+static void sim_enqueue(ubt_rpc_sim_t *sim, const uint8_t *buf, uint32_t len, uint32_t mask, uint32_t due, bool corrupt)
+{
+    rpc_sim_frame_t *frame;
+    rpc_sim_frame_t *pos;
+
+    if (sim->pending_num >= RPC_SIM_QUEUE_MAX) {
+        sim->stats.overflow++;
+        return;
+    }
+    frame = (rpc_sim_frame_t *)rpc_malloc(sizeof(rpc_sim_frame_t) + len);
+    if (!frame) {
+        sim->stats.overflow++;
+        return;
+    }
+    memcpy(frame->data, buf, len);
+    frame->len = len;
+    frame->mask = mask;
+    frame->due = due;
+    if (corrupt && len) {
+        uint32_t bit = sim_rand(sim) % (len * 8);
+        frame->data[bit / 8] ^= 1 << (bit % 8);
+        sim->stats.corrupted++;
+    }
+    /* equal due times keep write order */
+    list_for_each_entry(pos, &sim->pending, list) {
+        if (SIM_BEFORE(due, pos->due)) {
+            break;
+        }
+    }
+    list_add_tail(&frame->list, &pos->list);
+    sim->pending_num++;
+    if (sim->pending.next == &frame->list) {
+        osSemaphoreRelease(sim->wake);
+    }
+}
+
+static int sim_write(void *ctx, const uint8_t *buf, uint32_t len, uint32_t mask)
+{
+    ubt_rpc_sim_t *sim = (ubt_rpc_sim_t *)ctx;
+    uint32_t now = osKernelGetTickCount();
+    uint32_t due;
+    uint32_t delay;
+    uint64_t cost;
+    uint8_t copies;
+    bool corrupt;
+
+    osMutexAcquire(sim->lock, osWaitForever);
+    sim->stats.tx_frames++;
+    sim->stats.tx_bytes += len;
+    if (sim_chance(sim, sim->conf.loss)) {
+        /* a lost frame still took its time on the wire */
+        sim->stats.lost++;
+        copies = 0;
+    } else if (sim_chance(sim, sim->conf.duplicate)) {
+        sim->stats.duplicated++;
+        copies = 2;
+    } else {
+        copies = 1;
+    }
+
+    if (sim->conf.bandwidth) {
+        if (SIM_BEFORE(sim->link_free, now)) {
+            sim->link_free = now;
+            sim->link_rem = 0;
+        }
+        /* the remainder carries over, so small frames on a coarse tick still add up */
+        cost = (uint64_t)len * 1000 + sim->link_rem;
+        sim->link_free += (uint32_t)(cost / ((uint64_t)sim->conf.bandwidth * portTICK_PERIOD_MS));
+        sim->link_rem = cost % ((uint64_t)sim->conf.bandwidth * portTICK_PERIOD_MS);
+        now = sim->link_free;
+    }
+    while (copies--) {
+        corrupt = sim_chance(sim, sim->conf.corrupt);
+        delay = sim->conf.latency_ms;
+        if (sim->conf.jitter_ms) {
+            delay += sim_rand(sim) % (sim->conf.jitter_ms + 1);
+        }
+        if (sim_chance(sim, sim->conf.reorder)) {
+            sim->stats.reordered++;
+            due = now + SIM_MS_TO_TICKS(delay + sim->conf.reorder_ms);
+        } else {
+            due = now + SIM_MS_TO_TICKS(delay);
+            if (SIM_BEFORE(due, sim->last_due)) {
+                due = sim->last_due;
+            }
+            sim->last_due = due;
+        }
+        /* an undisturbed link writes straight through */
+        if (!corrupt && list_empty(&sim->pending) && !SIM_BEFORE(osKernelGetTickCount(), due)) {
+            sim_deliver(sim, buf, len, mask);
+        } else {
+            sim_enqueue(sim, buf, len, mask, due, corrupt);
+        }
+    }
+    osMutexRelease(sim->lock);
+    return 0;
+}
+
+static void sim_runner(void *argv)
+{
+    ubt_rpc_sim_t *sim = (ubt_rpc_sim_t *)argv;
+    rpc_sim_frame_t *frame;
+    uint32_t wait;
+    uint32_t now;
+
+    while (1) {
+        wait = osWaitForever;
+        /* the lower write is done under the lock, so destroy never cuts a frame in half */
+        osMutexAcquire(sim->lock, osWaitForever);
+        while (!list_empty(&sim->pending)) {
+            frame = list_entry(sim->pending.next, rpc_sim_frame_t, list);
+            now = osKernelGetTickCount();
+            if (SIM_BEFORE(now, frame->due)) {
+                wait = frame->due - now;
+                break;
+            }
+            list_del(&frame->list);
+            sim->pending_num--;
+            sim_deliver(sim, frame->data, frame->len, frame->mask);
+            rpc_free(frame);
+        }
+        osMutexRelease(sim->lock);
+        osSemaphoreAcquire(sim->wake, wait);
+    }
+}
+
+static int sim_read(void *ctx, uint8_t *buf, uint32_t len)
+{
+    ubt_rpc_sim_t *sim = (ubt_rpc_sim_t *)ctx;
+    return sim->lower.read(sim->lower.ctx, buf, len);
+}
+
+static osStatus_t sim_wait_data(void *ctx, uint32_t timeout)
+{
+    ubt_rpc_sim_t *sim = (ubt_rpc_sim_t *)ctx;
+    return sim->lower.wait_data(sim->lower.ctx, timeout);
+}
+
+static int sim_peek_frame(void *ctx, const uint8_t **frame, uint32_t *len)
+{
+    ubt_rpc_sim_t *sim = (ubt_rpc_sim_t *)ctx;
+    return sim->lower.peek_frame(sim->lower.ctx, frame, len);
+}
+
+static void sim_release_frame(void *ctx)
+{
+    ubt_rpc_sim_t *sim = (ubt_rpc_sim_t *)ctx;
+    sim->lower.release_frame(sim->lower.ctx);
+}
+
+ubt_rpc_sim_t *ubt_rpc_sim_create(const ubt_rpc_transport_t *lower, const ubt_rpc_sim_config_t *config)
+{
+    ubt_rpc_sim_t *sim;
+    osThreadAttr_t thread_attr = {
+        .name = "sim",
+        .attr_bits = 0,
+        .cb_mem = NULL,
+        .cb_size = 0,
+        .stack_mem = NULL,
+        .stack_size = RPC_SIM_STACK_SIZE,
+        .priority = osPriorityNormal,
+        .tz_module = 0,
+        .reserved = 0
+    };
+
+    sim = (ubt_rpc_sim_t *)rpc_malloc(sizeof(ubt_rpc_sim_t));
+    if (!sim) {
+        return NULL;
+    }
+    memset(sim, 0, sizeof(ubt_rpc_sim_t));
+    sim->lower = *lower;
+    list_init(&sim->pending);
+    sim->last_due = osKernelGetTickCount();
+    sim->link_free = sim->last_due;
+    ubt_rpc_sim_set_config(sim, config);
+
+    sim->lock = osMutexNew(NULL);
+    sim->wake = osSemaphoreNew(0xFFFFFFFF, 0, NULL);
+    if (!sim->lock || !sim->wake) {
+        ubt_rpc_sim_destroy(sim);
+        return NULL;
+    }
+    sim->thread = osThreadNew(sim_runner, sim, &thread_attr);
+    if (!sim->thread) {
+        ubt_rpc_sim_destroy(sim);
+        return NULL;
+    }
+    return sim;
+}
+
+/* frames still in flight are dropped */
+void ubt_rpc_sim_destroy(ubt_rpc_sim_t *sim)
+{
+    rpc_sim_frame_t *frame, *tmp;
+
+    if (!sim) {
+        return;
+    }
+    if (sim->lock) {
+        osMutexAcquire(sim->lock, osWaitForever);
+    }
+    if (sim->thread) {
+        osThreadTerminate(sim->thread);
+    }
+    list_for_each_entry_safe(frame, tmp, &sim->pending, list) {
+        list_del(&frame->list);
+        rpc_free(frame);
+    }
+    if (sim->wake) {
+        osSemaphoreDelete(sim->wake);
+    }
+    if (sim->lock) {
+        osMutexRelease(sim->lock);
+        osMutexDelete(sim->lock);
+    }
+    rpc_free(sim);
+}
+
+/* reseeds the generator, frames already in flight keep their fate */
+void ubt_rpc_sim_set_config(ubt_rpc_sim_t *sim, const ubt_rpc_sim_config_t *config)
+{
+    if (sim->lock) {
+        osMutexAcquire(sim->lock, osWaitForever);
+    }
+    sim->conf = *config;
+    sim->rand = config->seed ? config->seed : 1;
+    sim->link_rem = 0;
+    if (sim->lock) {
+        osMutexRelease(sim->lock);
+    }
+}
+
+void ubt_rpc_sim_get_stats(ubt_rpc_sim_t *sim, ubt_rpc_sim_stats_t *stats, bool reset)
+{
+    osMutexAcquire(sim->lock, osWaitForever);
+    *stats = sim->stats;
+    if (reset) {
+        memset(&sim->stats, 0, sizeof(sim->stats));
+    }
+    osMutexRelease(sim->lock);
+}
+
+void ubt_rpc_sim_transport(ubt_rpc_sim_t *sim, ubt_rpc_transport_t *transport)
+{
+    transport->ctx = sim;
+    transport->write = sim_write;
+    transport->read = sim_read;
+    transport->wait_data = sim_wait_data;
+    transport->peek_frame = sim->lower.peek_frame ? sim_peek_frame : NULL;
+    transport->release_frame = sim->lower.release_frame ? sim_release_frame : NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef __UBT_RPC_SIM_H__
+#define __UBT_RPC_SIM_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include "ubt_rpc_config.h"
+#include "ubt_rpc_transport.h"
+
+/*
+ * Link simulator stacked on any transport, for benchmarking retry/timeout/dedup
+ * behaviour. Every frame written is impaired on its way down, the receive side
+ * is passed through. All random decisions come from one seeded xorshift, so the
+ * same seed and the same sequence of writes give the same faults.
+ * Probabilities are in permille.
+ */
+typedef struct {
+    uint32_t seed;
+    uint16_t loss;
+    uint16_t corrupt;           // one bit flipped
+    uint16_t duplicate;
+    uint16_t reorder;           // held back reorder_ms, later frames overtake it
+    uint32_t reorder_ms;
+    uint32_t latency_ms;
+    uint32_t jitter_ms;         // uniform 0..jitter_ms added to the latency
+    uint32_t bandwidth;         // bytes per second, 0 unlimited
+} ubt_rpc_sim_config_t;
+
+typedef struct {
+    uint32_t tx_frames;         // offered by the layer above
+    uint32_t tx_bytes;
+    uint32_t delivered_frames;  // written to the lower transport
+    uint32_t delivered_bytes;
+    uint32_t lost;
+    uint32_t corrupted;
+    uint32_t duplicated;
+    uint32_t reordered;
+    uint32_t overflow;          // dropped because RPC_SIM_QUEUE_MAX frames were in flight
+} ubt_rpc_sim_stats_t;
+
+typedef struct ubt_rpc_sim ubt_rpc_sim_t;
+
+ubt_rpc_sim_t *ubt_rpc_sim_create(const ubt_rpc_transport_t *lower, const ubt_rpc_sim_config_t *config);
+void ubt_rpc_sim_destroy(ubt_rpc_sim_t *sim);
+void ubt_rpc_sim_set_config(ubt_rpc_sim_t *sim, const ubt_rpc_sim_config_t *config);
+void ubt_rpc_sim_get_stats(ubt_rpc_sim_t *sim, ubt_rpc_sim_stats_t *stats, bool reset);
+void ubt_rpc_sim_transport(ubt_rpc_sim_t *sim, ubt_rpc_transport_t *transport);
+
+#endif
@@ -0,0 +1,119 @@
+#include <string.h>
+#include "ubt_rpc_trace.h"
+
+#if RPC_TRACE_LEVEL > 0
+#define RPC_TRACE_MASK  (RPC_TRACE_RING_SIZE - 1)
+
+typedef struct {
+    osThreadId_t owner;     // the only writer of this ring
+    uint32_t head;          // records ever written, slot is head & RPC_TRACE_MASK
+    rpc_trace_rec_t rec[RPC_TRACE_RING_SIZE];
+} rpc_trace_ring_t;
+
+static rpc_trace_ring_t trace_ring[RPC_TRACE_RINGS];
+static uint32_t trace_dropped;
+
+static rpc_trace_ring_t *ubt_rpc_trace_ring(void)
+{
+    osThreadId_t self = osThreadGetId();
+    osThreadId_t expected;
+    uint8_t i;
+
+    for (i = 0; i < RPC_TRACE_RINGS; i++) {
+        if (__atomic_load_n(&trace_ring[i].owner, __ATOMIC_ACQUIRE) == self) {
+            return &trace_ring[i];
+        }
+    }
+    /* first record of this thread: claim a free ring */
+    for (i = 0; i < RPC_TRACE_RINGS; i++) {
+        expected = NULL;
+        if (__atomic_compare_exchange_n(&trace_ring[i].owner, &expected, self, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return &trace_ring[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Give the ring of thread back, NULL for the calling thread. A thread that traces must
+ * have it released when it exits; the handle is only compared, so a thread that has
+ * already been terminated may be passed. Its records stay until the next owner laps them.
+ */
+void ubt_rpc_trace_release(osThreadId_t thread)
+{
+    uint8_t i;
+
+    if (thread == NULL) {
+        thread = osThreadGetId();
+    }
+    for (i = 0; i < RPC_TRACE_RINGS; i++) {
+        if (__atomic_load_n(&trace_ring[i].owner, __ATOMIC_ACQUIRE) == thread) {
+            __atomic_store_n(&trace_ring[i].owner, NULL, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+void ubt_rpc_trace_write(uint16_t event, uint8_t ctrl, uint8_t err, uint32_t seq, uint32_t cmd, uint32_t arg)
+{
+    rpc_trace_ring_t *ring = ubt_rpc_trace_ring();
+    rpc_trace_rec_t *rec;
+    uint32_t head;
+
+    if (ring == NULL) {
+        __atomic_fetch_add(&trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    head = ring->head;
+    rec = &ring->rec[head & RPC_TRACE_MASK];
+    rec->tick = rpc_trace_get_tick();
+    rec->event = event;
+    rec->ctrl = ctrl;
+    rec->err = err;
+    rec->seq = seq;
+    rec->cmd = cmd;
+    rec->arg = arg;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy out the records still held by every ring, oldest first per ring.
+ * Records a writer may have overwritten during the copy are discarded;
+ * the offline decoder merges the rings by tick.
+ */
+uint32_t ubt_rpc_trace_dump(rpc_trace_rec_t *out, uint32_t max)
+{
+    uint32_t cnt = 0;
+    uint32_t head, start, idx, n, lost;
+    uint8_t i;
+
+    for (i = 0; i < RPC_TRACE_RINGS && cnt < max; i++) {
+        head = __atomic_load_n(&trace_ring[i].head, __ATOMIC_ACQUIRE);
+        n = (head > RPC_TRACE_RING_SIZE) ? RPC_TRACE_RING_SIZE : head;
+        if (n > max - cnt) {
+            n = max - cnt;
+        }
+        start = head - n;
+        for (idx = start; idx != head; idx++) {
+            out[cnt + idx - start] = trace_ring[i].rec[idx & RPC_TRACE_MASK];
+        }
+        /* the writer went on while copying: drop the records it lapped or was writing */
+        head = __atomic_load_n(&trace_ring[i].head, __ATOMIC_ACQUIRE);
+        lost = 0;
+        if (head + 1 - start > RPC_TRACE_RING_SIZE) {
+            lost = head + 1 - start - RPC_TRACE_RING_SIZE;
+            if (lost > n) {
+                lost = n;
+            }
+            memmove(&out[cnt], &out[cnt + lost], (n - lost) * sizeof(rpc_trace_rec_t));
+        }
+        cnt += n - lost;
+    }
+    return cnt;
+}
+
+uint32_t ubt_rpc_trace_dropped(void)
+{
+    return __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED);
+}
+#endif
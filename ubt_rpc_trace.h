@@ -0,0 +1,67 @@
+#ifndef __UBT_RPC_TRACE_H__
+#define __UBT_RPC_TRACE_H__
+#include <stdint.h>
+#include "ubt_rpc_config.h"
+#include "cmsis_os2.h"
+
+/*
+ * Binary trace: fixed size records in one ring per tracing thread, written
+ * without locks and decoded offline (or read back with ubt_rpc_trace_dump()
+ * from a request handler). Records above RPC_TRACE_LEVEL compile to nothing.
+ * A ring is held until ubt_rpc_trace_release(), once RPC_TRACE_RINGS threads hold
+ * one the records of any other thread are dropped and counted.
+ */
+#define RPC_TRACE_ERR   1
+#define RPC_TRACE_INFO  2
+#define RPC_TRACE_DBG   3
+
+enum {
+    RPC_EV_REQ_ALLOC = 1,   // arg: request
+    RPC_EV_REQ_FREE,        // arg: request
+    RPC_EV_MSG_FREE,        // arg: message
+    RPC_EV_PERFORM,         // arg: expect_ack
+    RPC_EV_DISPATCH,        // arg: message
+    RPC_EV_RESPONSE,        // arg: response cmd
+    RPC_EV_TIMEOUT,         // arg: timeout ms
+    RPC_EV_RETRANSMIT,      // arg: retry left
+    RPC_EV_ACK_DROP,        // arg: message
+    RPC_EV_DUP_DROP,        // arg: 0
+    RPC_EV_ACK_REPLAY,      // arg: cached response
+    RPC_EV_NO_CREDIT,       // arg: timeout ms
+    RPC_EV_RTT,             // arg: sampled rtt ms
+    RPC_EV_STREAM_OPEN,     // arg: 0 opened, -1 timeout, else the refusal err
+    RPC_EV_STREAM_PROBE,    // arg: chunks sent
+    RPC_EV_STREAM_LOST,     // arg: chunks written off
+    RPC_EV_STREAM_CLOSE,    // arg: 0 the peer answered the FIN, -1 gave up
+};
+
+typedef struct {
+    uint32_t tick;
+    uint16_t event;
+    uint8_t ctrl;
+    uint8_t err;
+    uint32_t seq;
+    uint32_t cmd;
+    uint32_t arg;
+} rpc_trace_rec_t;
+
+#if RPC_TRACE_LEVEL > 0
+#define RPC_TRACE(level, ev, ctrl, err, seq, cmd, arg) do { \
+        if ((level) <= RPC_TRACE_LEVEL) { \
+            ubt_rpc_trace_write((ev), (ctrl), (err), (seq), (cmd), (uint32_t)(uintptr_t)(arg)); \
+        } \
+    } while (0)
+
+void ubt_rpc_trace_write(uint16_t event, uint8_t ctrl, uint8_t err, uint32_t seq, uint32_t cmd, uint32_t arg);
+uint32_t ubt_rpc_trace_dump(rpc_trace_rec_t *out, uint32_t max);
+uint32_t ubt_rpc_trace_dropped(void);
+void ubt_rpc_trace_release(osThreadId_t thread);
+#else
+#define RPC_TRACE(level, ev, ctrl, err, seq, cmd, arg) do { } while (0)
+#define ubt_rpc_trace_release(thread) do { } while (0)
+#endif
+
+#define RPC_TRACE_MSG(level, ev, base, arg) \
+    RPC_TRACE(level, ev, (base)->ctrl, (base)->err, (base)->seq, (base)->cmd, arg)
+
+#endif
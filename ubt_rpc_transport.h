@@ -0,0 +1,20 @@
+#ifndef __UBT_RPC_TRANSPORT_H__
+#define __UBT_RPC_TRANSPORT_H__
+#include <stdint.h>
+#include "cmsis_os2.h"
+
+/*
+ * Link under the codec. write() sends one whole frame, read()/wait_data() are the
+ * byte stream side. peek_frame()/release_frame() are optional: a frame oriented
+ * transport hands a complete frame in place to the decoder, no copy.
+ */
+typedef struct ubt_rpc_transport {
+    void *ctx;
+    int (*write)(void *ctx, const uint8_t *buf, uint32_t len, uint32_t mask);
+    int (*read)(void *ctx, uint8_t *buf, uint32_t len);
+    osStatus_t (*wait_data)(void *ctx, uint32_t timeout);
+    int (*peek_frame)(void *ctx, const uint8_t **frame, uint32_t *len);
+    void (*release_frame)(void *ctx);
+} ubt_rpc_transport_t;
+
+#endif